@@ -0,0 +1,274 @@
+/*
+ * aiotest.c -- drive a device through native AIO and io_uring
+ *
+ * Fills the device through the native AIO interface (the one libaio
+ * wraps), then reads it back at queue depths from 1 up to -q, first
+ * with io_submit/io_getevents and then with an io_uring, verifying
+ * every buffer and printing the throughput of each engine and depth.
+ * Both are driven through raw system calls, so no library is needed.
+ * Run it on scullc, scullp, scullv or sculld to exercise their
+ * asynchronous read_iter/write_iter path.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/aio_abi.h>
+#include <linux/io_uring.h>
+
+#include "bench.h"
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#define __NR_io_uring_enter 426
+#endif
+
+#define MAXDEPTH 256
+
+static long bufsize = 4096, nbufs = 4096;
+static char *bufs[MAXDEPTH];
+
+/*
+ * Completions come back in any order, so buffers are handed out from
+ * a stack of free slots; the slot travels in the request's user data
+ * next to the block number.
+ */
+static int freeslots[MAXDEPTH], nfree;
+
+#define TAG(block, slot)	((unsigned long)(block) * MAXDEPTH + (slot))
+#define TAG_BLOCK(tag)		((long)((tag) / MAXDEPTH))
+#define TAG_SLOT(tag)		((int)((tag) % MAXDEPTH))
+
+static void init_slots(int depth)
+{
+	for (nfree = 0; nfree < depth; nfree++)
+		freeslots[nfree] = nfree;
+}
+
+/* Every block is filled with its own number, so misplaced data shows */
+static void fill(char *buf, long block)
+{
+	memset(buf, 'A' + block % 26, bufsize);
+}
+
+static int check(char *buf, long block, long len)
+{
+	long i;
+
+	if (len != bufsize)
+		return -1;
+	for (i = 0; i < len; i++)
+		if (buf[i] != 'A' + block % 26)
+			return -1;
+	return 0;
+}
+
+/*
+ * Native AIO, through the raw system calls. Run "nbufs" transfers
+ * keeping up to "depth" in flight; return the number of bad results.
+ */
+static long run_aio(int fd, int depth, int wr)
+{
+	aio_context_t ctx = 0;
+	struct iocb cbs[MAXDEPTH], *cbp[MAXDEPTH];
+	struct io_event events[MAXDEPTH];
+	long next = 0, done = 0, bad = 0;
+	int i, n, slot, inflight = 0;
+
+	if (syscall(__NR_io_setup, depth, &ctx) < 0)
+		die("io_setup");
+	init_slots(depth);
+	while (done < nbufs) {
+		/* top up the queue, reusing the free slots */
+		for (n = 0; inflight + n < depth && next < nbufs; n++, next++) {
+			slot = freeslots[--nfree];
+			memset(&cbs[slot], 0, sizeof(cbs[slot]));
+			cbs[slot].aio_fildes = fd;
+			cbs[slot].aio_lio_opcode = wr ? IOCB_CMD_PWRITE
+				: IOCB_CMD_PREAD;
+			cbs[slot].aio_buf = (unsigned long)bufs[slot];
+			cbs[slot].aio_nbytes = bufsize;
+			cbs[slot].aio_offset = next * bufsize;
+			cbs[slot].aio_data = TAG(next, slot);
+			if (wr)
+				fill(bufs[slot], next);
+			cbp[n] = &cbs[slot];
+		}
+		if (n && syscall(__NR_io_submit, ctx, n, cbp) != n)
+			die("io_submit");
+		inflight += n;
+
+		n = syscall(__NR_io_getevents, ctx, 1, inflight, events, NULL);
+		if (n < 0)
+			die("io_getevents");
+		for (i = 0; i < n; i++) {
+			long block = TAG_BLOCK(events[i].data);
+
+			slot = TAG_SLOT(events[i].data);
+			if (wr ? events[i].res != bufsize
+			    : check(bufs[slot], block, events[i].res))
+				bad++;
+			freeslots[nfree++] = slot;
+		}
+		inflight -= n;
+		done += n;
+	}
+	syscall(__NR_io_destroy, ctx);
+	return bad;
+}
+
+/*
+ * The same with an io_uring, using IORING_OP_READV so that kernels
+ * older than the plain read opcode work too.
+ */
+static long run_uring(int fd, int depth)
+{
+	struct io_uring_params p;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	struct iovec iov[MAXDEPTH];
+	unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+	unsigned tail, head;
+	long next = 0, done = 0, bad = 0;
+	char *sq, *cq;
+	size_t sqlen, cqlen;
+	int ring, n, slot, inflight = 0;
+
+	memset(&p, 0, sizeof(p));
+	ring = syscall(__NR_io_uring_setup, depth, &p);
+	if (ring < 0)
+		die("io_uring_setup");
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(*cqes);
+	sq = mmap(NULL, sqlen, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	cq = mmap(NULL, cqlen,
+		  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+		  IORING_OFF_CQ_RING);
+	sqes = mmap(NULL, p.sq_entries * sizeof(*sqes),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+		    IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+		die("mmap(io_uring)");
+	sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	sq_array = (unsigned *)(sq + p.sq_off.array);
+	cq_head = (unsigned *)(cq + p.cq_off.head);
+	cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	init_slots(depth);
+
+	while (done < nbufs) {
+		tail = *sq_tail;
+		for (n = 0; inflight + n < depth && next < nbufs; n++, next++) {
+			unsigned idx = tail & *sq_mask;
+
+			slot = freeslots[--nfree];
+			iov[slot].iov_base = bufs[slot];
+			iov[slot].iov_len = bufsize;
+			memset(&sqes[idx], 0, sizeof(sqes[idx]));
+			sqes[idx].opcode = IORING_OP_READV;
+			sqes[idx].fd = fd;
+			sqes[idx].addr = (unsigned long)&iov[slot];
+			sqes[idx].len = 1;
+			sqes[idx].off = next * bufsize;
+			sqes[idx].user_data = TAG(next, slot);
+			sq_array[idx] = idx;
+			tail++;
+		}
+		__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+		if (syscall(__NR_io_uring_enter, ring, n, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+			die("io_uring_enter");
+		inflight += n;
+
+		head = *cq_head;
+		while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+			long block = TAG_BLOCK(cqe->user_data);
+
+			slot = TAG_SLOT(cqe->user_data);
+			if (check(bufs[slot], block, cqe->res))
+				bad++;
+			freeslots[nfree++] = slot;
+			head++;
+			inflight--;
+			done++;
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	}
+	munmap(sqes, p.sq_entries * sizeof(*sqes));
+	munmap(cq, cqlen);
+	munmap(sq, sqlen);
+	close(ring);
+	return bad;
+}
+
+int main(int argc, char **argv)
+{
+	int fd, opt, depth, maxdepth = MAXDEPTH;
+	long bad;
+	double t;
+
+	prog = argv[0];
+	while ((opt = getopt(argc, argv, "b:n:q:")) != -1) {
+		switch (opt) {
+		case 'b': bufsize = atol(optarg); break;
+		case 'n': nbufs = atol(optarg); break;
+		case 'q': maxdepth = atoi(optarg); break;
+		default: optind = argc; /* force the usage message */
+		}
+	}
+	if (optind != argc - 1 || bufsize <= 0 || nbufs <= 0
+	    || maxdepth <= 0 || maxdepth > MAXDEPTH) {
+		fprintf(stderr, "%s: Usage \"%s [-b bufsize] [-n buffers] "
+			"[-q max-depth (%i)] <device>\"\n",
+			argv[0], argv[0], MAXDEPTH);
+		exit(1);
+	}
+	for (depth = 0; depth < maxdepth; depth++)
+		if (!(bufs[depth] = malloc(bufsize)))
+			die("malloc");
+
+	fd = open(argv[optind], O_RDWR);
+	if (fd < 0)
+		die(argv[optind]);
+
+	t = now();
+	bad = run_aio(fd, maxdepth, 1);
+	t = now() - t;
+	printf("aio write, depth %3i: %8.1f MB/s, %li errors\n", maxdepth,
+	       nbufs * bufsize / t / 1048576, bad);
+
+	for (depth = 1; depth <= maxdepth; depth *= 2) {
+		t = now();
+		bad = run_aio(fd, depth, 0);
+		t = now() - t;
+		printf("aio read,  depth %3i: %8.1f MB/s, %li errors\n", depth,
+		       nbufs * bufsize / t / 1048576, bad);
+
+		t = now();
+		bad = run_uring(fd, depth);
+		t = now() - t;
+		printf("uring read, depth %3i: %8.1f MB/s, %li errors\n", depth,
+		       nbufs * bufsize / t / 1048576, bad);
+	}
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * appendbench.c -- many threads appending small records to one device
+ *
+ * For 1, 2, 4 ... up to "max" threads, each thread opens the device
+ * with O_APPEND and appends its share of "size" megabytes in records
+ * of "recsize" bytes. The appends/s are printed, and then the device
+ * is read back to check that every record got there, whole. scullc
+ * loaded with scullc_stage set collects such appends in per-CPU
+ * buffers and takes its lock once per buffer; with -d the files are
+ * opened O_DSYNC as well, which makes it store (and lock) for every
+ * write, for comparison. Only scull devices will do: they are emptied
+ * by a write-only open.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bench.h"
+
+static char *fname;
+static long recsize = 64, nrec; /* records per thread */
+static int flags = O_RDWR | O_APPEND;
+
+/* Each record starts with this, and is filled with a byte from it */
+struct rechead {
+	int thread;
+	int seq;
+};
+
+static void record(char *rec, int thread, int seq)
+{
+	struct rechead h = { thread, seq };
+
+	memset(rec, 'a' + (thread + seq) % 26, recsize);
+	memcpy(rec, &h, sizeof(h));
+}
+
+static void *writer(void *arg)
+{
+	int thread = (long)arg, fd, i;
+	char *rec = malloc(recsize);
+
+	if (!rec)
+		die("malloc");
+	fd = open(fname, flags);
+	if (fd < 0)
+		die(fname);
+	for (i = 0; i < nrec; i++) {
+		record(rec, thread, i);
+		if (write(fd, rec, recsize) != recsize)
+			die("write");
+	}
+	close(fd); /* this flushes what we staged */
+	free(rec);
+	return NULL;
+}
+
+/* Read it all back: every record whole, and all of them there */
+static void check(int nthreads)
+{
+	char *rec = malloc(recsize), *want = malloc(recsize);
+	long *count = calloc(nthreads, sizeof(long)), i;
+	struct rechead h;
+	ssize_t n, done;
+	int fd;
+
+	if (!rec || !want || !count)
+		die("malloc");
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		die(fname);
+	for (i = 0; i < nthreads * nrec; i++) {
+		for (done = 0; done < recsize; done += n) {
+			n = read(fd, rec + done, recsize - done);
+			if (n < 0)
+				die("read");
+			if (n == 0) {
+				fprintf(stderr, "%s: only %li records of %li\n",
+					prog, i, nthreads * nrec);
+				exit(1);
+			}
+		}
+		memcpy(&h, rec, sizeof(h));
+		if (h.thread < 0 || h.thread >= nthreads) {
+			fprintf(stderr, "%s: record %li is garbage\n", prog, i);
+			exit(1);
+		}
+		record(want, h.thread, h.seq);
+		if (memcmp(rec, want, recsize)) {
+			fprintf(stderr, "%s: record %li is torn\n", prog, i);
+			exit(1);
+		}
+		count[h.thread]++;
+	}
+	if (read(fd, rec, 1) != 0) {
+		fprintf(stderr, "%s: more data than records\n", prog);
+		exit(1);
+	}
+	for (i = 0; i < nthreads; i++)
+		if (count[i] != nrec) {
+			fprintf(stderr, "%s: thread %li has %li records, not %li\n",
+				prog, i, count[i], nrec);
+			exit(1);
+		}
+	close(fd);
+	free(rec);
+	free(want);
+	free(count);
+}
+
+int main(int argc, char **argv)
+{
+	long size = 64, i;
+	int fd, opt, max = 64, nthreads;
+	pthread_t *threads;
+	double t;
+
+	prog = argv[0];
+	while ((opt = getopt(argc, argv, "s:r:t:d")) != -1) {
+		switch (opt) {
+		case 's': size = atol(optarg); break;
+		case 'r': recsize = atol(optarg); break;
+		case 't': max = atoi(optarg); break;
+		case 'd': flags |= O_DSYNC; break;
+		default: optind = argc; /* force the usage message */
+		}
+	}
+	if (optind != argc - 1 || size <= 0 || max <= 0
+	    || recsize < sizeof(struct rechead)) {
+		fprintf(stderr, "%s: Usage \"%s [-s size-MB] [-r record-size] "
+			"[-t max-threads] [-d] <device>\"\n", prog, prog);
+		exit(1);
+	}
+	fname = argv[optind];
+	threads = malloc(max * sizeof(*threads));
+	if (!threads)
+		die("malloc");
+
+	printf("%8s %14s %10s\n", "threads", "appends/s", "MB/s");
+	for (nthreads = 1; nthreads <= max; nthreads *= 2) {
+		nrec = size * MB / recsize / nthreads;
+		fd = open(fname, O_WRONLY); /* this trims it */
+		if (fd < 0)
+			die(fname);
+		close(fd);
+
+		t = now();
+		for (i = 0; i < nthreads; i++)
+			if (pthread_create(threads + i, NULL, writer, (void *)i))
+				die("pthread_create");
+		for (i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+		t = now() - t;
+		printf("%8i %14.0f %10.1f\n", nthreads, nthreads * nrec / t,
+		       nthreads * nrec * recsize / t / MB);
+		fflush(stdout);
+		check(nthreads);
+	}
+	return 0;
+}
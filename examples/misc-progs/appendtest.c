@@ -0,0 +1,177 @@
+/*
+ * appendtest.c -- check that concurrent O_APPEND writers never mix
+ *
+ * Forks "procs" processes that open the device on their own with
+ * O_APPEND and write "count" records each, of sizes picked at random
+ * up to "max" bytes, so that many of them straddle a quantum. Nothing
+ * is shared between them but the device. Once they are all done the
+ * device is read back as a stream of records: each must be whole,
+ * each writer's records must come in the order they were written, and
+ * all of them must be there. Records no bigger than scull_append_max
+ * (64 kB by default) are what scull promises to keep in one piece.
+ * Only scull devices will do: they are emptied by a write-only open.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+static char *fname;
+
+/* Each record starts with this, and is filled with a byte from it */
+struct rechead {
+	int proc;
+	int seq;
+	int len;
+};
+
+static void record(char *rec, int proc, int seq, int len)
+{
+	struct rechead h = { proc, seq, len };
+
+	memset(rec, 'a' + (proc * 7 + seq) % 26, len);
+	memcpy(rec, &h, sizeof(h));
+}
+
+static void writer(int proc, int count, int max)
+{
+	char *rec = malloc(max);
+	int fd, i, len, head = sizeof(struct rechead);
+
+	if (!rec)
+		die("malloc");
+	fd = open(fname, O_WRONLY | O_APPEND);
+	if (fd < 0)
+		die(fname);
+	srandom(proc + 1);
+	for (i = 0; i < count; i++) {
+		len = head + random() % (max - head + 1);
+		record(rec, proc, i, len);
+		if (write(fd, rec, len) != len)
+			die("write");
+	}
+	close(fd);
+	exit(0);
+}
+
+static int readall(int fd, char *buf, int len)
+{
+	int n, done;
+
+	for (done = 0; done < len; done += n) {
+		n = read(fd, buf + done, len - done);
+		if (n < 0)
+			die("read");
+		if (n == 0)
+			break;
+	}
+	return done;
+}
+
+/* Read the device back as records, and check every one */
+static void check(int procs, int count, int max)
+{
+	char *rec = malloc(max), *want = malloc(max);
+	int *next = calloc(procs, sizeof(int)), fd, i;
+	struct rechead h;
+	long n, off = 0;
+
+	if (!rec || !want || !next)
+		die("malloc");
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		die(fname);
+	for (n = 0; (i = readall(fd, rec, sizeof(h))) > 0; n++) {
+		memcpy(&h, rec, sizeof(h));
+		if (i < sizeof(h) || h.proc < 0 || h.proc >= procs
+		    || h.len < sizeof(h) || h.len > max
+		    || readall(fd, rec + sizeof(h), h.len - sizeof(h))
+		       != h.len - sizeof(h)) {
+			fprintf(stderr, "%s: garbage at offset %li\n", prog, off);
+			exit(1);
+		}
+		if (h.seq != next[h.proc]) {
+			fprintf(stderr, "%s: writer %i: record %i at offset %li,"
+				" expected %i\n", prog, h.proc, h.seq, off,
+				next[h.proc]);
+			exit(1);
+		}
+		record(want, h.proc, h.seq, h.len);
+		if (memcmp(rec, want, h.len)) {
+			fprintf(stderr, "%s: record at offset %li is torn\n",
+				prog, off);
+			exit(1);
+		}
+		next[h.proc]++;
+		off += h.len;
+	}
+	for (i = 0; i < procs; i++)
+		if (next[i] != count) {
+			fprintf(stderr, "%s: writer %i has %i records, not %i\n",
+				prog, i, next[i], count);
+			exit(1);
+		}
+	printf("%li records, %li bytes, none torn or out of place\n", n, off);
+	close(fd);
+	free(rec);
+	free(want);
+	free(next);
+}
+
+int main(int argc, char **argv)
+{
+	int fd, opt, i, status, procs = 8, count = 10000, max = 10000;
+	pid_t pid;
+
+	prog = argv[0];
+	while ((opt = getopt(argc, argv, "p:n:r:")) != -1) {
+		switch (opt) {
+		case 'p': procs = atoi(optarg); break;
+		case 'n': count = atoi(optarg); break;
+		case 'r': max = atoi(optarg); break;
+		default: optind = argc; /* force the usage message */
+		}
+	}
+	if (optind != argc - 1 || procs <= 0 || count <= 0
+	    || max < sizeof(struct rechead)) {
+		fprintf(stderr, "%s: Usage \"%s [-p processes] [-n records] "
+			"[-r max-record-size] <device>\"\n", prog, prog);
+		exit(1);
+	}
+	fname = argv[optind];
+
+	fd = open(fname, O_WRONLY); /* this trims it */
+	if (fd < 0)
+		die(fname);
+	close(fd);
+
+	for (i = 0; i < procs; i++) {
+		pid = fork();
+		if (pid < 0)
+			die("fork");
+		if (pid == 0)
+			writer(i, count, max);
+	}
+	for (i = 0; i < procs; i++) {
+		if (wait(&status) < 0)
+			die("wait");
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			exit(1); /* the writer said why */
+	}
+	check(procs, count, max);
+	return 0;
+}
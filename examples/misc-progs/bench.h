@@ -0,0 +1,46 @@
+/*
+ * bench.h -- what the benchmarks and tests in misc-progs have in common
+ *
+ * The ioctl numbers and structures come from the drivers' own headers,
+ * which only define them outside the kernel: include "scull/scull.h"
+ * and the like, the Makefile puts the examples directory in the path.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define MB (1024L * 1024L)
+
+static char *prog;	/* argv[0], for the messages */
+
+/* A monotonic clock, in seconds */
+static inline double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Say what failed, and why, and give up */
+static inline void die(const char *what)
+{
+	fprintf(stderr, "%s: %s: %s\n", prog, what, strerror(errno));
+	exit(1);
+}
+
+#endif /* _BENCH_H_ */
@@ -0,0 +1,190 @@
+/*
+ * castbench.c -- one writer, many readers of a broadcasting scullpipe
+ *
+ * The pipe is put in broadcast mode with the policy given, and "readers"
+ * processes each open it and read every record a writer sends, "count"
+ * records of "recsize" bytes through a ring of "slots" of them. With
+ * -s, the first reader sleeps that many microseconds after each record,
+ * to see what the policy does with a laggard: with "block" everyone
+ * goes at its pace, with "drop" it misses records (and says how many
+ * bytes, by SCULL_P_IOCQLOST), with "disconnect" it is cut off. Every
+ * reader checks that its records come in order and, unless dropping,
+ * with no gaps. A drop leaves the reader on a record boundary because
+ * the records are written whole and the ring holds a whole number of
+ * them. The total is what all readers got together, per second.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "scull/scull.h"
+
+static char *policies[] = { "off", "block", "drop", "disconnect" };
+
+static long recsize = 64, count = 1000000, slots = 256, slow;
+static int readers = 8, policy = 1;
+
+/* What each reader found, in memory shared with the writer */
+struct result {
+	double end;		/* when the end record got in */
+	long got, missed;	/* records */
+	long lost;		/* bytes, says the driver */
+	int cut;		/* ECONNRESET */
+};
+
+/* Records carry their number; the last one is -1 */
+static void reader(int fd, int laggard, struct result *res)
+{
+	char *rec = malloc(recsize);
+	long seq, next = 0;
+	ssize_t n;
+
+	if (!rec)
+		die("malloc");
+	for (;;) {
+		n = read(fd, rec, recsize);
+		if (n < 0 && errno == ECONNRESET) {
+			res->cut = 1;
+			break;
+		}
+		if (n != recsize)
+			die("read");
+		memcpy(&seq, rec, sizeof(seq));
+		if (seq < 0)
+			break;
+		if (seq < next || (seq > next && policy != 2)) {
+			fprintf(stderr, "%s: record %li where %li should be\n",
+				prog, seq, next);
+			exit(1);
+		}
+		res->missed += seq - next;
+		res->got++;
+		next = seq + 1;
+		if (laggard && slow)
+			usleep(slow);
+	}
+	res->end = now();
+	res->lost = ioctl(fd, SCULL_P_IOCQLOST);
+	free(rec);
+}
+
+int main(int argc, char **argv)
+{
+	struct result *res;
+	int fd, *rfd, opt, i, status;
+	long seq, got = 0;
+	double t, end = 0;
+	char *rec;
+	pid_t pid;
+
+	prog = argv[0];
+	while ((opt = getopt(argc, argv, "p:c:n:r:S:s:")) != -1) {
+		switch (opt) {
+		case 'p':
+			for (policy = 3; policy > 0; policy--)
+				if (!strcmp(optarg, policies[policy]))
+					break;
+			if (!policy)
+				optind = argc;
+			break;
+		case 'c': readers = atoi(optarg); break;
+		case 'n': count = atol(optarg); break;
+		case 'r': recsize = atol(optarg); break;
+		case 'S': slots = atol(optarg); break;
+		case 's': slow = atol(optarg); break;
+		default: optind = argc; /* force the usage message */
+		}
+	}
+	if (optind != argc - 1 || readers < 1 || count < 1 || slots < 2
+	    || recsize < sizeof(long) || recsize > 4096) {
+		fprintf(stderr, "%s: Usage \"%s [-p block|drop|disconnect] "
+			"[-c readers] [-n records] [-r record-size] "
+			"[-S ring-slots] [-s laggard-us] <scullpipe>\"\n",
+			prog, prog);
+		exit(1);
+	}
+
+	res = mmap(NULL, readers * sizeof(*res), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	rfd = malloc(readers * sizeof(int));
+	rec = malloc(recsize);
+	if (res == MAP_FAILED || !rfd || !rec)
+		die("memory");
+	memset(res, 0, readers * sizeof(*res));
+
+	fd = open(argv[optind], O_WRONLY);
+	if (fd < 0)
+		die(argv[optind]);
+	/* a whole number of records, plus the byte the ring keeps free */
+	if (ioctl(fd, SCULL_P_IOCTRING, slots * recsize + 1) < 0)
+		die("SCULL_P_IOCTRING");
+	if (ioctl(fd, SCULL_P_IOCTCAST, policy) < 0)
+		die("SCULL_P_IOCTCAST");
+
+	/* every open is a reader with a cursor of its own */
+	for (i = 0; i < readers; i++)
+		if ((rfd[i] = open(argv[optind], O_RDONLY)) < 0)
+			die(argv[optind]);
+	for (i = 0; i < readers; i++) {
+		pid = fork();
+		if (pid < 0)
+			die("fork");
+		if (pid == 0) {
+			reader(rfd[i], i == 0, res + i);
+			exit(0);
+		}
+	}
+	for (i = 0; i < readers; i++)
+		close(rfd[i]);
+
+	memset(rec, 'c', recsize);
+	t = now();
+	for (seq = 0; seq <= count; seq++) {
+		long s = seq < count ? seq : -1;
+
+		memcpy(rec, &s, sizeof(s));
+		if (write(fd, rec, recsize) != recsize)
+			die("write");
+	}
+	for (i = 0; i < readers; i++) {
+		if (wait(&status) < 0)
+			die("wait");
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			exit(1); /* the reader said why */
+	}
+
+	printf("%i readers, %li records of %li bytes, %li in the ring, "
+	       "policy %s\n", readers, count, recsize, slots, policies[policy]);
+	for (i = 0; i < readers; i++) {
+		got += res[i].got;
+		if (res[i].end > end)
+			end = res[i].end;
+		if (res[i].cut)
+			printf("reader %i: cut off after %li records\n", i,
+			       res[i].got);
+		else if (res[i].missed)
+			printf("reader %i: missed %li records (%li bytes)\n",
+			       i, res[i].missed, res[i].lost);
+	}
+	printf("%.0f records/s delivered, %.1f MB/s\n", got / (end - t),
+	       got * recsize / (end - t) / 1e6);
+	close(fd);
+	return 0;
+}
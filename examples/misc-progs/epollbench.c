@@ -0,0 +1,192 @@
+/*
+ * epollbench.c -- one epoll loop over many scullpipe devices
+ *
+ * Opens "pipes" scullpipe devices, registers all of them with one epoll
+ * instance for EPOLLIN (edge-triggered with -e), and then a writer
+ * process sends "count" timestamped 8-byte records to pipes picked at
+ * random, while the loop reads them back. Reported are the time taken
+ * to register the pipes, the records per second, how many records each
+ * event brought, and the latency from the write to the read.
+ *
+ * Pipes past the first are the devices with the following minor
+ * numbers; their nodes are made in a directory of our own, which
+ * takes root, as loading the module does. Load it with enough of them:
+ * "scull_load scull_p_nr_devs=10000" for the full 10000. Every pipe
+ * is opened for both reading and writing, one descriptor each, so the
+ * writer shares them with the loop and the loop's epoll entries sit on
+ * descriptors that are also written through.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+static int pipes = 1000, count = 1000000, edge;
+
+/* Open the first pipe and the "pipes - 1" after it */
+static int *open_pipes(char *first)
+{
+	char dir[] = "/tmp/epollbenchXXXXXX", name[64];
+	int *fd = malloc(pipes * sizeof(int)), i;
+	struct rlimit rl;
+	struct stat st;
+
+	if (!fd)
+		die("malloc");
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		die("getrlimit");
+	if (rl.rlim_cur < pipes + 16) {
+		rl.rlim_cur = rl.rlim_max = pipes + 16;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+			die("setrlimit");
+	}
+	if (stat(first, &st) < 0)
+		die(first);
+	if (!S_ISCHR(st.st_mode)) {
+		fprintf(stderr, "%s: %s: not a device\n", prog, first);
+		exit(1);
+	}
+	if (pipes > 1 && !mkdtemp(dir))
+		die("mkdtemp");
+	for (i = 0; i < pipes; i++) {
+		if (i == 0) {
+			fd[i] = open(first, O_RDWR | O_NONBLOCK);
+			if (fd[i] < 0)
+				die(first);
+			continue;
+		}
+		sprintf(name, "%s/%i", dir, i);
+		if (mknod(name, S_IFCHR | 0600, makedev(major(st.st_rdev),
+				minor(st.st_rdev) + i)) < 0)
+			die("mknod");
+		fd[i] = open(name, O_RDWR | O_NONBLOCK);
+		if (fd[i] < 0) {
+			fprintf(stderr, "%s: pipe %i: %s (is scull_p_nr_devs "
+				"large enough?)\n", prog, i, strerror(errno));
+			exit(1);
+		}
+		unlink(name);
+	}
+	if (pipes > 1)
+		rmdir(dir);
+	return fd;
+}
+
+/* Send the records, skipping pipes that are full */
+static void writer(int *fd)
+{
+	double t;
+	int i;
+
+	srandom(1);
+	for (i = 0; i < count; ) {
+		t = now();
+		if (write(fd[random() % pipes], &t, sizeof(t)) == sizeof(t))
+			i++;
+		else if (errno != EAGAIN)
+			die("write");
+	}
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	struct epoll_event ev, *events;
+	double buf[512], t, latency = 0;
+	long got = 0, nevents = 0, waits = 0;
+	int *fd, ep, opt, i, j, n, k, status;
+	pid_t pid;
+
+	prog = argv[0];
+	while ((opt = getopt(argc, argv, "p:n:e")) != -1) {
+		switch (opt) {
+		case 'p': pipes = atoi(optarg); break;
+		case 'n': count = atoi(optarg); break;
+		case 'e': edge = 1; break;
+		default: optind = argc; /* force the usage message */
+		}
+	}
+	if (optind != argc - 1 || pipes <= 0 || count <= 0) {
+		fprintf(stderr, "%s: Usage \"%s [-p pipes] [-n records] [-e] "
+			"<scullpipe0>\"\n", prog, prog);
+		exit(1);
+	}
+	fd = open_pipes(argv[optind]);
+	events = malloc(256 * sizeof(*events));
+	if (!events)
+		die("malloc");
+
+	ep = epoll_create1(0);
+	if (ep < 0)
+		die("epoll_create1");
+	t = now();
+	for (i = 0; i < pipes; i++) {
+		ev.events = EPOLLIN | (edge ? EPOLLET : 0);
+		ev.data.u32 = i;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, fd[i], &ev) < 0)
+			die("epoll_ctl");
+	}
+	printf("%i pipes, %s-triggered: registered in %.1f us each\n", pipes,
+	       edge ? "edge" : "level", (now() - t) / pipes * 1e6);
+
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid == 0)
+		writer(fd);
+
+	t = now();
+	while (got < count) {
+		n = epoll_wait(ep, events, 256, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			die("epoll_wait");
+		}
+		waits++;
+		nevents += n;
+		for (i = 0; i < n; i++) {
+			/* drain it: edge-triggered, there's no other chance */
+			while ((k = read(fd[events[i].data.u32], buf,
+					sizeof(buf))) > 0) {
+				for (j = 0; j < k / sizeof(double); j++)
+					latency += now() - buf[j];
+				got += k / sizeof(double);
+			}
+			if (k < 0 && errno != EAGAIN)
+				die("read");
+		}
+	}
+	t = now() - t;
+	if (waitpid(pid, &status, 0) < 0)
+		die("waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		exit(1); /* the writer said why */
+
+	printf("%.0f records/s, %.2f records per event, %.1f events per wait,"
+	       " latency %.1f us\n", got / t, (double)got / nevents,
+	       (double)nevents / waits, latency / got * 1e6);
+	close(ep);
+	for (i = 0; i < pipes; i++)
+		close(fd[i]);
+	return 0;
+}
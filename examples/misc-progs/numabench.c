@@ -0,0 +1,202 @@
+/*
+ * numabench.c -- read bandwidth of a device against where its memory is
+ *
+ * For each node with memory, the device (scullc or scullp) is told to
+ * place its quanta there, filled with "size" megabytes, and then read
+ * back a few times from each node with CPUs, with the process pinned
+ * to that node. The same is done with the quanta interleaved over all
+ * the nodes. The MB/s are printed as a table: a row per placement, a
+ * column per reading node, so remote reads stand out. The placement
+ * policy the device had is restored at the end.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#define _GNU_SOURCE /* sched_setaffinity() and the CPU_* macros */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+
+#include "bench.h"
+#include "scullp/scullp.h" /* scullc has the same numbers, as SCULLC_ */
+
+#define MAXNODES 1024
+
+static char *fname;
+
+/*
+ * Parse a list like "0-3,8,10-11" from a sysfs file, calling "add"
+ * for each number; return how many there were.
+ */
+static int parse_list(const char *file, void (*add)(int, void *), void *arg)
+{
+	char buf[4096], *s;
+	int a, b, count = 0;
+	FILE *f = fopen(file, "r");
+
+	if (!f)
+		return 0;
+	if (!fgets(buf, sizeof(buf), f))
+		buf[0] = '\0';
+	fclose(f);
+	for (s = buf; *s >= '0' && *s <= '9'; ) {
+		a = b = strtol(s, &s, 10);
+		if (*s == '-')
+			b = strtol(s + 1, &s, 10);
+		for (; a <= b; a++, count++)
+			add(a, arg);
+		if (*s == ',')
+			s++;
+	}
+	return count;
+}
+
+static void add_node(int node, void *arg)
+{
+	int *nodes = arg;
+
+	if (nodes[0] < MAXNODES)
+		nodes[++nodes[0]] = node;
+}
+
+static void add_cpu(int cpu, void *arg)
+{
+	CPU_SET(cpu, (cpu_set_t *)arg);
+}
+
+/* Run on the CPUs of a node from now on */
+static void pin(int node)
+{
+	char file[80];
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	sprintf(file, "/sys/devices/system/node/node%i/cpulist", node);
+	if (!parse_list(file, add_cpu, &cpus)) {
+		fprintf(stderr, "%s: no CPUs in node %i\n", prog, node);
+		exit(1);
+	}
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+		die("sched_setaffinity");
+}
+
+/* Set the placement, and fill the device from scratch */
+static void fill(int policy, char *buffer, long size)
+{
+	ssize_t n;
+	long done;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		die(fname);
+	if (ioctl(fd, SCULLP_IOCSNUMA, &policy) < 0)
+		die("SCULLP_IOCSNUMA");
+	close(fd);
+	fd = open(fname, O_WRONLY); /* this trims it */
+	if (fd < 0)
+		die(fname);
+	for (done = 0; done < size * MB; done += n)
+		if ((n = write(fd, buffer, MB)) <= 0)
+			die("write");
+	close(fd);
+}
+
+/* Read it all back "passes" times, return the MB/s */
+static double readall(char *buffer, long size, int passes)
+{
+	ssize_t n;
+	long done;
+	double t;
+	int fd, p;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		die(fname);
+	t = now();
+	for (p = 0; p < passes; p++) {
+		lseek(fd, 0, SEEK_SET);
+		for (done = 0; done < size * MB; done += n)
+			if ((n = read(fd, buffer, MB)) <= 0)
+				die("read");
+	}
+	t = now() - t;
+	close(fd);
+	return size * passes / t;
+}
+
+int main(int argc, char **argv)
+{
+	static int memnodes[MAXNODES + 1], cpunodes[MAXNODES + 1];
+	long size = 256;
+	int fd, opt, i, j, passes = 4, oldpolicy, policy;
+	char *buffer;
+
+	prog = argv[0];
+	while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+		switch (opt) {
+		case 's': size = atol(optarg); break;
+		case 'n': passes = atoi(optarg); break;
+		default: optind = argc; /* force the usage message */
+		}
+	}
+	if (optind != argc - 1 || size <= 0 || passes <= 0) {
+		fprintf(stderr, "%s: Usage \"%s [-s size-MB] [-n passes] "
+			"<device>\"\n", prog, prog);
+		exit(1);
+	}
+	fname = argv[optind];
+	buffer = malloc(MB);
+	if (!buffer)
+		die("malloc");
+	memset(buffer, 'n', MB);
+
+	/* the first entry is the count */
+	parse_list("/sys/devices/system/node/has_memory", add_node, memnodes);
+	parse_list("/sys/devices/system/node/has_cpu", add_node, cpunodes);
+	if (!memnodes[0] || !cpunodes[0]) {
+		fprintf(stderr, "%s: can't find the NUMA nodes in sysfs\n", prog);
+		exit(1);
+	}
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		die(fname);
+	if (ioctl(fd, SCULLP_IOCGNUMA, &oldpolicy) < 0)
+		die("SCULLP_IOCGNUMA");
+	close(fd);
+
+	printf("%-12s", "data\\reader");
+	for (j = 1; j <= cpunodes[0]; j++)
+		printf("   node %-4i", cpunodes[j]);
+	printf("  (MB/s)\n");
+	for (i = 1; i <= memnodes[0] + 1; i++) {
+		policy = i <= memnodes[0] ? memnodes[i] : SCULL_NUMA_INTERLEAVE;
+		fill(policy, buffer, size);
+		if (policy >= 0)
+			printf("node %-7i", policy);
+		else
+			printf("%-12s", "interleave");
+		for (j = 1; j <= cpunodes[0]; j++) {
+			pin(cpunodes[j]);
+			printf(" %11.1f", readall(buffer, size, passes));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+
+	fill(oldpolicy, buffer, 0); /* leave it as it was, and empty */
+	return 0;
+}
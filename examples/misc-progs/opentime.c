@@ -0,0 +1,110 @@
+/*
+ * opentime.c -- how long a write-only open takes, against the device size
+ *
+ * Opening scull write-only empties the device. For sizes from 0 up to
+ * "max" megabytes, fill the device, then time the open that throws the
+ * data away (best of a few tries). If trimming is done in the open the
+ * time grows with the size; if it is left to a background worker it
+ * stays flat.
+ *
+ * This should run with any Unix, but it's only meaningful on scull.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "bench.h"
+
+#define TRIES 3
+
+static char *fname;
+
+static int xopen(int flags)
+{
+	int fd = open(fname, flags);
+
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prog, fname, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+/* Fill the device with "size" megabytes, return the open time of that */
+static double fill(char *buffer, long bufsize, long size)
+{
+	long done;
+	double t;
+	ssize_t n;
+	int fd;
+
+	t = now();
+	fd = xopen(O_WRONLY); /* this trims what was there */
+	t = now() - t;
+	for (done = 0; done < size * MB; done += n) {
+		n = write(fd, buffer, bufsize);
+		if (n <= 0) {
+			fprintf(stderr, "%s: write: %s\n", prog,
+				n ? strerror(errno) : "short write");
+			exit(1);
+		}
+	}
+	close(fd);
+	return t;
+}
+
+int main(int argc, char **argv)
+{
+	long max = 1024, bufsize = 65536, size;
+	double t, best;
+	char *buffer;
+	int i, opt;
+
+	prog = argv[0];
+	while ((opt = getopt(argc, argv, "m:")) != -1) {
+		switch (opt) {
+		case 'm': max = atol(optarg); break;
+		default: optind = argc; /* force the usage message */
+		}
+	}
+	if (optind != argc - 1 || max < 0) {
+		fprintf(stderr, "%s: Usage \"%s [-m max-MB] <device>\"\n",
+			prog, prog);
+		exit(1);
+	}
+	fname = argv[optind];
+
+	buffer = malloc(bufsize);
+	if (!buffer) {
+		fprintf(stderr, "%s: out of memory\n", prog);
+		exit(1);
+	}
+	memset(buffer, 'o', bufsize);
+
+	printf("%10s %14s\n", "size-MB", "open-us");
+	for (size = 0; size <= max; size = size ? size * 4 : 1) {
+		/* each fill is timed while trimming the previous one */
+		fill(buffer, bufsize, size);
+		for (best = 1e9, i = 0; i < TRIES; i++) {
+			t = fill(buffer, bufsize, size);
+			if (t < best)
+				best = t;
+		}
+		printf("%10li %14.1f\n", size, best * 1e6);
+	}
+	fill(buffer, bufsize, 0); /* don't leave it full */
+	return 0;
+}
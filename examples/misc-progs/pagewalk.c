@@ -0,0 +1,143 @@
+/*
+ * pagewalk.c -- map a device and time page-by-page accesses through it
+ *
+ * Fills the device with "size" megabytes, maps it like mapper does
+ * (but shared, and without printing), and touches one word in every
+ * page: once to fault the pages in, and then for a few passes in
+ * sequential, strided and random order. The random walk is dominated
+ * by TLB misses, however large the device's quanta are: they are all
+ * mapped a page at a time.
+ * With -P the area is mapped with MAP_POPULATE, and with -w it is
+ * madvise()d with MADV_WILLNEED before the walks, and the time that
+ * takes is printed too; try "-s 1024" on scullp and scullv, whose
+ * faults also map the neighbouring pages, to see what is left to pay.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "bench.h"
+
+/* Touch the pages in the order given, return ns per page */
+static double walk(volatile char *map, long *order, long npages,
+		   long pagesize, int passes, unsigned long *sum)
+{
+	double t;
+	long i;
+	int p;
+
+	t = now();
+	for (p = 0; p < passes; p++)
+		for (i = 0; i < npages; i++)
+			*sum += map[order[i] * pagesize];
+	return (now() - t) / passes / npages * 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	long size = 256, pagesize = sysconf(_SC_PAGESIZE), npages, i, j, tmp;
+	long stride = 512; /* pages: 2 MB apart with 4 kB pages */
+	long *order;
+	int fd, opt, passes = 4, populate = 0, willneed = 0;
+	unsigned long sum = 0;
+	char *buffer, *map;
+	ssize_t n;
+	double t;
+
+	prog = argv[0];
+	while ((opt = getopt(argc, argv, "s:n:Pw")) != -1) {
+		switch (opt) {
+		case 's': size = atol(optarg); break;
+		case 'n': passes = atoi(optarg); break;
+		case 'P': populate = 1; break;
+		case 'w': willneed = 1; break;
+		default: optind = argc; /* force the usage message */
+		}
+	}
+	if (optind != argc - 1 || size <= 0 || passes <= 0) {
+		fprintf(stderr, "%s: Usage \"%s [-s size-MB] [-n passes] [-P] "
+			"[-w] <device>\"\n", prog, prog);
+		exit(1);
+	}
+	npages = size * MB / pagesize;
+
+	/* O_WRONLY trims the device, so we start from scratch */
+	fd = open(argv[optind], O_WRONLY);
+	buffer = malloc(MB);
+	order = malloc(npages * sizeof(*order));
+	if (fd < 0)
+		die(argv[optind]);
+	if (!buffer || !order)
+		die("malloc");
+	memset(buffer, 'w', MB);
+	for (i = 0; i < size; i++)
+		for (j = 0; j < MB; j += n)
+			if ((n = write(fd, buffer + j, MB - j)) <= 0)
+				die("write");
+	close(fd);
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0)
+		die(argv[optind]);
+	t = now();
+	map = mmap(NULL, size * MB, PROT_READ,
+		   MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, 0);
+	if (map == MAP_FAILED)
+		die("mmap");
+	t = now() - t;
+	printf("mapped %li MB at %p (%s2 MB aligned)\n", size, map,
+	       ((unsigned long)map & (2 * MB - 1)) ? "not " : "");
+	if (populate)
+		printf("%10s %10.1f ns/page\n", "populate", t / npages * 1e9);
+	if (willneed) {
+		t = now();
+		if (madvise(map, size * MB, MADV_WILLNEED) < 0)
+			die("madvise");
+		t = now() - t;
+		printf("%10s %10.1f ns/page\n", "willneed", t / npages * 1e9);
+	}
+
+	for (i = 0; i < npages; i++)
+		order[i] = i;
+	t = walk(map, order, npages, pagesize, 1, &sum);
+	printf("%10s %10.1f ns/page\n", "fault-in", t);
+	t = walk(map, order, npages, pagesize, passes, &sum);
+	printf("%10s %10.1f ns/page\n", "sequential", t);
+
+	for (i = 0, j = 0; i < npages; i++) { /* every stride-th, then +1 ... */
+		order[i] = j;
+		j += stride;
+		if (j >= npages)
+			j = j % stride + 1;
+	}
+	t = walk(map, order, npages, pagesize, passes, &sum);
+	printf("%10s %10.1f ns/page\n", "strided", t);
+
+	srandom(1);
+	for (i = 0; i < npages; i++)
+		order[i] = i;
+	for (i = npages - 1; i > 0; i--) { /* shuffle */
+		j = random() % (i + 1);
+		tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+	}
+	t = walk(map, order, npages, pagesize, passes, &sum);
+	printf("%10s %10.1f ns/page\n", "random", t);
+
+	munmap(map, size * MB);
+	close(fd);
+	return sum == 1; /* keep the compiler from dropping the loads */
+}
@@ -0,0 +1,217 @@
+/*
+ * pipebench.c -- bulk throughput and ping-pong latency through a pipe
+ *
+ * A child process writes "size" megabytes into the pipe while the
+ * parent reads them, and the throughput is printed. If a second pipe
+ * is named, the two processes then bounce a small message back and
+ * forth through the pair and the average round-trip time is printed.
+ * Works on scullpipe devices as well as on FIFOs made with mkfifo,
+ * which gives a baseline to compare against. With -a the bulk transfer
+ * is repeated for buffer sizes from 512 bytes to a megabyte, showing
+ * how many bytes each read returns as the requests outgrow the ring.
+ * On scullpipe, -p resizes the ring first, to compare ring sizes too,
+ * and -W sets the wakeup watermarks (high:low:timeout-ms), after which
+ * the wakeups done and avoided are printed; try it with a small -b.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+
+#include "bench.h"
+#include "scull/scull.h"
+
+static long bufsizes[] = { 512, 4096, 16384, 65536, 262144, 1048576, 0 };
+
+static int xopen(char *name, int flags)
+{
+	int fd = open(name, flags);
+
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prog, name, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+/* Move exactly "len" bytes, however the driver splits them up */
+static void xfer(int fd, char *buf, long len, int wr)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = wr ? write(fd, buf, len) : read(fd, buf, len);
+		if (n <= 0) {
+			fprintf(stderr, "%s: %s: %s\n", prog,
+				wr ? "write" : "read",
+				n ? strerror(errno) : "unexpected EOF");
+			exit(1);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void bulk(char *name, long size, long bufsize)
+{
+	char *buffer = malloc(bufsize);
+	long done, calls = 0;
+	double t;
+	ssize_t n;
+	pid_t pid;
+	int fd;
+
+	if (!buffer) {
+		fprintf(stderr, "%s: out of memory\n", prog);
+		exit(1);
+	}
+	memset(buffer, 'p', bufsize);
+
+	fflush(stdout); /* or the child prints it again */
+	pid = fork();
+	if (pid == 0) {
+		fd = xopen(name, O_WRONLY);
+		for (done = 0; done < size * MB; done += bufsize)
+			xfer(fd, buffer, bufsize, 1);
+		exit(0);
+	}
+	fd = xopen(name, O_RDONLY);
+	t = now();
+	for (done = 0; done < size * MB; done += n, calls++) {
+		n = read(fd, buffer, bufsize);
+		if (n <= 0) {
+			fprintf(stderr, "%s: read: %s\n", prog,
+				n ? strerror(errno) : "unexpected EOF");
+			exit(1);
+		}
+	}
+	t = now() - t;
+	close(fd);
+	waitpid(pid, NULL, 0);
+	printf("bulk: %li MB with %li-byte buffers: %.1f MB/s, "
+	       "%.1f bytes per read\n", size, bufsize, size / t,
+	       (double)size * MB / calls);
+	free(buffer);
+}
+
+static void pingpong(char *there, char *back, long rounds, long msgsize)
+{
+	char *msg = malloc(msgsize);
+	int out, in;
+	long i;
+	double t;
+	pid_t pid;
+
+	if (!msg) {
+		fprintf(stderr, "%s: out of memory\n", prog);
+		exit(1);
+	}
+	memset(msg, '!', msgsize);
+
+	fflush(stdout); /* or the child prints it again */
+	pid = fork();
+	if (pid == 0) { /* echo everything back */
+		in = xopen(there, O_RDONLY);
+		out = xopen(back, O_WRONLY);
+		for (i = 0; i < rounds; i++) {
+			xfer(in, msg, msgsize, 0);
+			xfer(out, msg, msgsize, 1);
+		}
+		exit(0);
+	}
+	out = xopen(there, O_WRONLY);
+	in = xopen(back, O_RDONLY);
+	t = now();
+	for (i = 0; i < rounds; i++) {
+		xfer(out, msg, msgsize, 1);
+		xfer(in, msg, msgsize, 0);
+	}
+	t = now() - t;
+	close(out);
+	close(in);
+	waitpid(pid, NULL, 0);
+	printf("ping-pong: %li rounds of %li bytes: %.2f us per round trip\n",
+	       rounds, msgsize, t / rounds * 1e6);
+	free(msg);
+}
+
+int main(int argc, char **argv)
+{
+	long size = 256, bufsize = 65536, rounds = 100000, msgsize = 1;
+	long ring = 0;
+	struct scull_p_water water;
+	struct scull_p_stats stats;
+	int fd = -1, opt, i, sweep = 0, setwater = 0;
+
+	prog = argv[0];
+	while ((opt = getopt(argc, argv, "s:b:r:m:ap:W:")) != -1) {
+		switch (opt) {
+		case 's': size = atol(optarg); break;
+		case 'b': bufsize = atol(optarg); break;
+		case 'r': rounds = atol(optarg); break;
+		case 'm': msgsize = atol(optarg); break;
+		case 'a': sweep = 1; break;
+		case 'p': ring = atol(optarg); break;
+		case 'W':
+			if (sscanf(optarg, "%i:%i:%i", &water.high, &water.low,
+				   &water.timeout) != 3)
+				optind = argc;
+			setwater = 1;
+			break;
+		default: optind = argc; /* force the usage message */
+		}
+	}
+	if (optind < argc - 2 || optind > argc - 1 || size <= 0
+	    || bufsize <= 0 || rounds <= 0 || msgsize <= 0 || ring < 0) {
+		fprintf(stderr, "%s: Usage \"%s [-s size-MB] [-b bufsize] [-a] "
+			"[-p ring-size] [-W high:low:ms] [-r rounds] [-m msgsize] "
+			"<pipe> [<return-pipe>]\"\n",
+			prog, prog);
+		exit(1);
+	}
+
+	if (ring || setwater)
+		/*
+		 * The ring only lasts while the pipe is open, so keep
+		 * this file descriptor until we are done.
+		 */
+		fd = xopen(argv[optind], O_RDONLY | O_NONBLOCK);
+	if (ring) {
+		ring = ioctl(fd, SCULL_P_IOCTRING, ring);
+		if (ring < 0) {
+			fprintf(stderr, "%s: resize: %s\n", prog, strerror(errno));
+			exit(1);
+		}
+		printf("ring: %li bytes\n", ring);
+	}
+	if (setwater && ioctl(fd, SCULL_P_IOCSWATER, &water) < 0) {
+		fprintf(stderr, "%s: watermarks: %s\n", prog, strerror(errno));
+		exit(1);
+	}
+	if (sweep)
+		for (i = 0; bufsizes[i]; i++)
+			bulk(argv[optind], size, bufsizes[i]);
+	else
+		bulk(argv[optind], size, bufsize);
+	if (optind == argc - 2)
+		pingpong(argv[optind], argv[optind + 1], rounds, msgsize);
+	if (setwater && ioctl(fd, SCULL_P_IOCGSTATS, &stats) == 0)
+		printf("reader wakeups: %lu, %lu avoided\n"
+		       "writer wakeups: %lu, %lu avoided\n", stats.rwakeups,
+		       stats.rskipped, stats.wwakeups, stats.wskipped);
+	return 0;
+}
@@ -0,0 +1,183 @@
+/*
+ * readbench.c -- aggregate read throughput with several reader threads
+ *
+ * Fills the device once, then for 1, 2, 4 ... threads (up to the number
+ * of online CPUs, or the -t argument) has every thread open the device
+ * on its own and read it from start to end over and over for a fixed
+ * time. If the driver lets readers share the device, the aggregate
+ * throughput scales with the number of threads; if every read takes an
+ * exclusive lock it stays flat. With -m the threads map the device and
+ * scan the mapping instead, summing it a word at a time, which shows
+ * what the copies and system calls of read() cost (scull must be loaded
+ * with scull_pages=1 for that).
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "bench.h"
+
+static char *fname;
+static long size = 64, bufsize = 65536;
+static int mapped;
+static double seconds = 2.0;
+static volatile int stop;
+
+struct reader {
+	pthread_t thread;
+	long bytes;
+	unsigned long sum;
+	int error;
+};
+
+/* Scan the device through a mapping, bufsize bytes between checks */
+static void mapper(struct reader *r, int fd)
+{
+	long *map, *p, *end, off = 0;
+	unsigned long sum = 0;
+
+	map = mmap(NULL, size * MB, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		r->error = errno;
+		return;
+	}
+	while (!stop) {
+		p = map + off / sizeof(long);
+		end = p + bufsize / sizeof(long);
+		while (p < end)
+			sum += *p++;
+		r->bytes += bufsize;
+		off += bufsize;
+		if (off + bufsize > size * MB) /* end of device: start over */
+			off = 0;
+	}
+	r->sum = sum; /* keep the compiler from dropping the loads */
+	munmap(map, size * MB);
+}
+
+static void *reader(void *arg)
+{
+	struct reader *r = arg;
+	char *buffer = malloc(bufsize);
+	ssize_t n;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0 || !buffer) {
+		r->error = fd < 0 ? errno : ENOMEM;
+		return NULL;
+	}
+	if (mapped)
+		mapper(r, fd);
+	while (!mapped && !stop) {
+		n = read(fd, buffer, bufsize);
+		if (n < 0) {
+			r->error = errno;
+			break;
+		}
+		if (n == 0) /* end of device: start over */
+			lseek(fd, 0, SEEK_SET);
+		r->bytes += n;
+	}
+	close(fd);
+	free(buffer);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	long maxthreads, done, total, i, nthr;
+	struct reader *readers;
+	char *buffer;
+	double t;
+	ssize_t n;
+	int fd, opt;
+
+	prog = argv[0];
+	maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "s:b:t:d:m")) != -1) {
+		switch (opt) {
+		case 's': size = atol(optarg); break;
+		case 'b': bufsize = atol(optarg); break;
+		case 't': maxthreads = atol(optarg); break;
+		case 'd': seconds = atof(optarg); break;
+		case 'm': mapped = 1; break;
+		default: optind = argc; /* force the usage message */
+		}
+	}
+	if (optind != argc - 1 || size <= 0 || bufsize <= 0 || maxthreads <= 0
+	    || seconds <= 0 || (mapped && (bufsize % sizeof(long)
+					   || bufsize > size * MB))) {
+		fprintf(stderr, "%s: Usage \"%s [-s size-MB] [-b bufsize] "
+			"[-t max-threads] [-d seconds] [-m] <device>\"\n",
+			argv[0], argv[0]);
+		exit(1);
+	}
+	fname = argv[optind];
+
+	buffer = malloc(bufsize);
+	readers = calloc(maxthreads, sizeof(*readers));
+	if (!buffer || !readers) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		exit(1);
+	}
+	memset(buffer, 'r', bufsize);
+
+	/* O_WRONLY trims the device, so we start from scratch */
+	fd = open(fname, O_WRONLY);
+	if (fd < 0)
+		die(fname);
+	for (done = 0; done < size * MB; done += n) {
+		n = write(fd, buffer, bufsize);
+		if (n <= 0) {
+			fprintf(stderr, "%s: write: %s\n", argv[0],
+				n ? strerror(errno) : "short write");
+			exit(1);
+		}
+	}
+	close(fd);
+
+	printf("%8s %12s %14s\n", "threads", "MB/s", "MB/s/thread");
+	for (nthr = 1; ; nthr *= 2) {
+		if (nthr > maxthreads) /* always end with all of them */
+			nthr = maxthreads;
+		memset(readers, 0, maxthreads * sizeof(*readers));
+		stop = 0;
+		t = now();
+		for (i = 0; i < nthr; i++)
+			pthread_create(&readers[i].thread, NULL, reader,
+				       readers + i);
+		usleep(seconds * 1e6);
+		stop = 1;
+		for (total = 0, i = 0; i < nthr; i++) {
+			pthread_join(readers[i].thread, NULL);
+			if (readers[i].error) {
+				fprintf(stderr, "%s: reader %li: %s\n", argv[0],
+					i, strerror(readers[i].error));
+				exit(1);
+			}
+			total += readers[i].bytes;
+		}
+		t = now() - t;
+		printf("%8li %12.1f %14.1f\n", nthr, total / t / MB,
+		       total / t / MB / nthr);
+		if (nthr == maxthreads)
+			break;
+	}
+	return 0;
+}
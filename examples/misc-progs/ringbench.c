@@ -0,0 +1,296 @@
+/*
+ * ringbench.c -- records through scullpipe: read/write against its mapped ring
+ *
+ * A producer and a consumer process pass "count" records of "recsize"
+ * bytes through the pipe, whose ring is set to hold "slots" of them.
+ * First they use write() and read(); then the ring is made mappable
+ * (SCULL_P_IOCMAP), both map it, and copy the records in and out of it
+ * themselves, moving the indices in the index page, so that system
+ * calls are left for when the ring is found empty or full: poll() to
+ * wait, and SCULL_P_IOCWAKE to wake the other side. For each way the
+ * throughput is measured with the producer going flat out, and then
+ * the latency, from the producer's timestamp in the record to the
+ * consumer having it, with the producer sending one record at a time
+ * every "gap" microseconds so that the ring stays empty in between.
+ * Every record is checked for its sequence number.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "scull/scull.h"
+
+static long recsize = 64, count = 1000000, slots = 256, gap = 20;
+
+/* What the consumer found, in memory shared with the producer */
+struct result {
+	double end;		/* when the last record got in */
+	double latency, maxlat;	/* sum and worst, in seconds */
+};
+
+/* Each record starts with this */
+struct rechead {
+	long seq;
+	double sent;
+};
+
+static void wait_for(int fd, short events)
+{
+	struct pollfd pfd = { fd, events, 0 };
+
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		die("poll");
+}
+
+/*
+ * The mapped ring, as seen by either side
+ */
+static struct scull_p_ring *ring;
+static char *data;
+
+static unsigned int used(unsigned int rp, unsigned int wp)
+{
+	return (wp + ring->size - rp) % ring->size;
+}
+
+static void ring_put(int fd, char *rec)
+{
+	unsigned int wp = ring->wp, rp, first;
+
+	for (;;) {
+		rp = __atomic_load_n(&ring->rp, __ATOMIC_ACQUIRE);
+		if (ring->size - 1 - used(rp, wp) >= recsize)
+			break;
+		/* full: raise the flag, look again, then sleep */
+		__atomic_store_n(&ring->wwait, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		rp = __atomic_load_n(&ring->rp, __ATOMIC_ACQUIRE);
+		if (ring->size - 1 - used(rp, wp) < recsize)
+			wait_for(fd, POLLOUT);
+	}
+	first = ring->size - wp < recsize ? ring->size - wp : recsize;
+	memcpy(data + wp, rec, first);
+	memcpy(data, rec + first, recsize - first);
+	__atomic_store_n(&ring->wp, (wp + recsize) % ring->size,
+			 __ATOMIC_RELEASE);
+
+	/* then wake the consumer, if it said it was waiting */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->rwait, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&ring->rwait, 0, __ATOMIC_RELAXED);
+		if (ioctl(fd, SCULL_P_IOCWAKE, POLLIN) < 0)
+			die("SCULL_P_IOCWAKE");
+	}
+}
+
+static void ring_get(int fd, char *rec)
+{
+	unsigned int rp = ring->rp, wp, first;
+
+	for (;;) {
+		wp = __atomic_load_n(&ring->wp, __ATOMIC_ACQUIRE);
+		if (used(rp, wp) >= recsize)
+			break;
+		__atomic_store_n(&ring->rwait, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		wp = __atomic_load_n(&ring->wp, __ATOMIC_ACQUIRE);
+		if (used(rp, wp) < recsize)
+			wait_for(fd, POLLIN);
+	}
+	first = ring->size - rp < recsize ? ring->size - rp : recsize;
+	memcpy(rec, data + rp, first);
+	memcpy(rec + first, data, recsize - first);
+	__atomic_store_n(&ring->rp, (rp + recsize) % ring->size,
+			 __ATOMIC_RELEASE);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->wwait, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&ring->wwait, 0, __ATOMIC_RELAXED);
+		if (ioctl(fd, SCULL_P_IOCWAKE, POLLOUT) < 0)
+			die("SCULL_P_IOCWAKE");
+	}
+}
+
+/*
+ * And the system calls
+ */
+static void sys_put(int fd, char *rec)
+{
+	if (write(fd, rec, recsize) != recsize)
+		die("write");
+}
+
+static void sys_get(int fd, char *rec)
+{
+	ssize_t n, done;
+
+	for (done = 0; done < recsize; done += n)
+		if ((n = read(fd, rec + done, recsize - done)) <= 0)
+			die("read");
+}
+
+static void consumer(int fd, int mapped, long n, struct result *res)
+{
+	struct rechead h;
+	char *rec = malloc(recsize);
+	double t = 0, lat;
+	long i;
+
+	if (!rec)
+		die("malloc");
+	memset(res, 0, sizeof(*res));
+	for (i = 0; i < n; i++) {
+		if (mapped)
+			ring_get(fd, rec);
+		else
+			sys_get(fd, rec);
+		t = now();
+		memcpy(&h, rec, sizeof(h));
+		if (h.seq != i) {
+			fprintf(stderr, "%s: record %li where %li should be\n",
+				prog, h.seq, i);
+			exit(1);
+		}
+		lat = t - h.sent;
+		res->latency += lat;
+		if (lat > res->maxlat)
+			res->maxlat = lat;
+	}
+	res->end = t;
+	free(rec);
+}
+
+static void producer(int fd, int mapped, long n, int paced)
+{
+	struct rechead h;
+	char *rec = malloc(recsize);
+	double next = now();
+	long i;
+
+	if (!rec)
+		die("malloc");
+	memset(rec, 'p', recsize);
+	for (i = 0; i < n; i++) {
+		if (paced) { /* spin, so as not to add a wakeup of our own */
+			next += gap / 1e6;
+			while (now() < next)
+				;
+		}
+		h.seq = i;
+		h.sent = now();
+		memcpy(rec, &h, sizeof(h));
+		if (mapped)
+			ring_put(fd, rec);
+		else
+			sys_put(fd, rec);
+	}
+	free(rec);
+}
+
+/* One run: fork the consumer, produce, and report */
+static void run(int fd, int mapped, int paced, struct result *res)
+{
+	long n = paced ? count / 10 : count;
+	int status;
+	double t;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid == 0) {
+		consumer(fd, mapped, n, res);
+		exit(0);
+	}
+	t = now();
+	producer(fd, mapped, n, paced);
+	if (waitpid(pid, &status, 0) < 0)
+		die("waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		exit(1); /* the consumer said why */
+
+	if (!paced)
+		printf("%10s %12.0f %10.1f", mapped ? "mapped" : "read/write",
+		       n / (res->end - t), n * recsize / (res->end - t) / 1e6);
+	else
+		printf(" %12.2f %12.2f\n", res->latency / n * 1e6,
+		       res->maxlat * 1e6);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	struct result *res;
+	long size, maplen;
+	int fd, opt;
+
+	prog = argv[0];
+	while ((opt = getopt(argc, argv, "n:r:s:g:")) != -1) {
+		switch (opt) {
+		case 'n': count = atol(optarg); break;
+		case 'r': recsize = atol(optarg); break;
+		case 's': slots = atol(optarg); break;
+		case 'g': gap = atol(optarg); break;
+		default: optind = argc; /* force the usage message */
+		}
+	}
+	if (optind != argc - 1 || count < 10 || slots < 1 || gap < 0
+	    || recsize < sizeof(struct rechead)) {
+		fprintf(stderr, "%s: Usage \"%s [-n records] [-r record-size] "
+			"[-s ring-slots] [-g gap-us] <scullpipe>\"\n",
+			prog, prog);
+		exit(1);
+	}
+	/* records fill the ring exactly, leaving the byte it keeps free */
+	size = slots * recsize + 1;
+
+	res = mmap(NULL, sizeof(*res), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (res == MAP_FAILED)
+		die("mmap");
+	fd = open(argv[optind], O_RDWR); /* both sides share it */
+	if (fd < 0)
+		die(argv[optind]);
+
+	printf("%li records of %li bytes, %li in the ring\n", count, recsize,
+	       slots);
+	printf("%10s %12s %10s %12s %12s\n", "", "records/s", "MB/s",
+	       "latency(us)", "max(us)");
+
+	if (ioctl(fd, SCULL_P_IOCTRING, size) < 0)
+		die("SCULL_P_IOCTRING");
+	run(fd, 0, 0, res);
+	run(fd, 0, 1, res);
+
+	maplen = ioctl(fd, SCULL_P_IOCMAP, size);
+	if (maplen < 0)
+		die("SCULL_P_IOCMAP");
+	ring = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+		die("mmap of the ring");
+	data = (char *)ring + sysconf(_SC_PAGESIZE);
+	run(fd, 1, 0, res);
+	run(fd, 1, 1, res);
+
+	munmap(ring, maplen);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * rwbench.c -- read/write throughput and syscall count versus buffer size
+ *
+ * For each buffer size, rewrite the whole device and read it back,
+ * counting how many system calls it took. A driver that stops every
+ * transfer at a quantum boundary shows the bytes per call capped at
+ * the quantum size; one that loops across quanta returns the whole
+ * request, and the throughput grows with the buffer.
+ *
+ * This should run with any Unix, but it's only meaningful on scull.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "bench.h"
+
+static long bufsizes[] = { 4000, 16384, 65536, 262144, 1048576, 0 };
+
+/* Move "total" bytes through fd, return the number of calls or -1 */
+static long transfer(int fd, char *buffer, long bufsize, long total, int wr)
+{
+	long done, calls = 0;
+	ssize_t n;
+
+	for (done = 0; done < total; done += n, calls++) {
+		if (wr)
+			n = write(fd, buffer, bufsize);
+		else
+			n = read(fd, buffer, bufsize);
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			errno = EIO; /* unexpected EOF */
+			return -1;
+		}
+	}
+	return calls;
+}
+
+int main(int argc, char **argv)
+{
+	long size = 64, calls, i;
+	char *buffer, *fname;
+	double t;
+	int fd, wr;
+
+	prog = argv[0];
+	if (argc < 2 || argc > 3 || (argc == 3 && (size = atol(argv[2])) <= 0)) {
+		fprintf(stderr, "%s: Usage \"%s <device> [size-MB]\"\n",
+			argv[0], argv[0]);
+		exit(1);
+	}
+	fname = argv[1];
+
+	buffer = malloc(bufsizes[sizeof(bufsizes) / sizeof(*bufsizes) - 2]);
+	if (!buffer) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		exit(1);
+	}
+
+	printf("%10s %6s %10s %12s %10s\n", "bufsize", "op", "calls",
+	       "bytes/call", "MB/s");
+	for (i = 0; bufsizes[i]; i++) {
+		memset(buffer, 'a' + i, bufsizes[i]);
+		for (wr = 1; wr >= 0; wr--) {
+			/* O_WRONLY trims the device, so each pass starts empty */
+			fd = open(fname, wr ? O_WRONLY : O_RDONLY);
+			if (fd < 0)
+				die(fname);
+			t = now();
+			calls = transfer(fd, buffer, bufsizes[i], size * MB, wr);
+			t = now() - t;
+			if (calls < 0)
+				die(wr ? "write" : "read");
+			close(fd);
+			printf("%10li %6s %10li %12.1f %10.1f\n", bufsizes[i],
+			       wr ? "write" : "read", calls,
+			       (double)size * MB / calls, size / t);
+		}
+	}
+	return 0;
+}
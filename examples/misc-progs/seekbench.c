@@ -0,0 +1,107 @@
+/*
+ * seekbench.c -- read throughput of a scull device as a function of offset
+ *
+ * Fills the device with "size" megabytes, then reads a fixed-size window
+ * at evenly spaced offsets and prints the throughput of each window. If
+ * the driver looks up an offset in constant time the numbers are flat;
+ * if it walks a list from the head they drop as the offset grows.
+ *
+ * This should run with any Unix, but it's only meaningful on scull.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include "bench.h"
+
+static void usage(char *name)
+{
+	fprintf(stderr, "%s: Usage \"%s [-s size-MB] [-w window-MB] "
+		"[-b bufsize] [-n steps] <device>\"\n", name, name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	long size = 256, window = 4, bufsize = 65536, steps = 16;
+	long done, off, step;
+	char *buffer, *fname;
+	double t;
+	ssize_t n;
+	int fd, opt;
+
+	prog = argv[0];
+	while ((opt = getopt(argc, argv, "s:w:b:n:")) != -1) {
+		switch (opt) {
+		case 's': size = atol(optarg); break;
+		case 'w': window = atol(optarg); break;
+		case 'b': bufsize = atol(optarg); break;
+		case 'n': steps = atol(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || size <= 0 || window <= 0 || bufsize <= 0
+	    || steps <= 0 || window > size)
+		usage(argv[0]);
+	fname = argv[optind];
+
+	buffer = malloc(bufsize);
+	if (!buffer) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		exit(1);
+	}
+	memset(buffer, 'x', bufsize);
+
+	/* O_WRONLY trims the device, so we start from scratch */
+	fd = open(fname, O_WRONLY);
+	if (fd < 0)
+		die(fname);
+	t = now();
+	for (done = 0; done < size * MB; done += n) {
+		n = write(fd, buffer, bufsize);
+		if (n <= 0) {
+			fprintf(stderr, "%s: write: %s\n", argv[0],
+				n ? strerror(errno) : "short write");
+			exit(1);
+		}
+	}
+	t = now() - t;
+	close(fd);
+	printf("filled %li MB in %.3f s (%.1f MB/s)\n", size, t, size / t);
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		die(fname);
+	printf("%12s %12s\n", "offset-MB", "MB/s");
+	step = steps > 1 ? (size - window) * MB / (steps - 1) : 0;
+	for (off = 0; off < steps; off++) {
+		if (lseek(fd, off * step, SEEK_SET) < 0)
+			die("lseek");
+		t = now();
+		for (done = 0; done < window * MB; done += n) {
+			n = read(fd, buffer, bufsize);
+			if (n <= 0) {
+				fprintf(stderr, "%s: read: %s\n", argv[0],
+					n ? strerror(errno) : "unexpected EOF");
+				exit(1);
+			}
+		}
+		t = now() - t;
+		printf("%12.1f %12.1f\n", (double)off * step / MB, window / t);
+	}
+	close(fd);
+	return 0;
+}
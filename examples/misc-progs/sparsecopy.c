@@ -0,0 +1,116 @@
+/*
+ * sparsecopy.c -- copy a sparse device to a file, skipping the holes
+ *
+ * Walks the source with SEEK_DATA and SEEK_HOLE and copies only the
+ * data extents, leaving holes in the (truncated) destination, so the
+ * time taken depends on the data and not on the size. With -p, a hole
+ * is punched in the scull device first with SCULL_IOCPUNCH. The
+ * extents found are printed, along with the time of the copy.
+ * Works on sparse regular files too.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#define _GNU_SOURCE /* SEEK_DATA and SEEK_HOLE */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "bench.h"
+#include "scull/scull.h"
+
+/* Copy "len" bytes at "off" from one file to the other */
+static void copy(int in, int out, off_t off, off_t len)
+{
+	static char buffer[65536];
+	ssize_t n, m;
+
+	while (len > 0) {
+		n = pread(in, buffer, len < sizeof(buffer) ? len : sizeof(buffer),
+			  off);
+		if (n < 0)
+			die("read");
+		if (n == 0)
+			break;
+		m = pwrite(out, buffer, n, off);
+		if (m != n)
+			die("write");
+		off += n;
+		len -= n;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct scull_punch punch;
+	off_t size, data, hole, total = 0;
+	int in, out, opt, dopunch = 0, extents = 0;
+	double t;
+
+	prog = argv[0];
+	while ((opt = getopt(argc, argv, "p:")) != -1) {
+		switch (opt) {
+		case 'p':
+			if (sscanf(optarg, "%lli:%lli", &punch.offset,
+				   &punch.len) != 2)
+				optind = argc;
+			dopunch = 1;
+			break;
+		default: optind = argc; /* force the usage message */
+		}
+	}
+	if (optind != argc - 2) {
+		fprintf(stderr, "%s: Usage \"%s [-p offset:len] <source> "
+			"<destination>\"\n", prog, prog);
+		exit(1);
+	}
+
+	in = open(argv[optind], dopunch ? O_RDWR : O_RDONLY);
+	if (in < 0)
+		die(argv[optind]);
+	if (dopunch && ioctl(in, SCULL_IOCPUNCH, &punch) < 0)
+		die("punch");
+	out = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0)
+		die(argv[optind + 1]);
+
+	t = now();
+	size = lseek(in, 0, SEEK_END);
+	if (size < 0)
+		die("lseek");
+	for (data = 0; data < size; data = hole) {
+		data = lseek(in, data, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO) /* only a hole is left */
+				break;
+			die("SEEK_DATA");
+		}
+		hole = lseek(in, data, SEEK_HOLE);
+		if (hole < 0)
+			die("SEEK_HOLE");
+		copy(in, out, data, hole - data);
+		printf("data %12lli - %12lli\n", (long long)data,
+		       (long long)hole);
+		total += hole - data;
+		extents++;
+	}
+	if (ftruncate(out, size) < 0) /* the trailing hole */
+		die("ftruncate");
+	t = now() - t;
+	printf("%i extents, %lli of %lli bytes copied in %.3f s\n", extents,
+	       (long long)total, (long long)size, t);
+	close(in);
+	close(out);
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * stagetest.c -- check that staged appends can be read right back
+ *
+ * Appends "count" records of sizes picked at random up to "max" bytes
+ * to a scullc device, hopping to the next CPU before each one, and
+ * after each append reads the record back through another descriptor
+ * and looks at where the end of the device is. Nothing may be missing
+ * or late: scullc stores what is staged before a read or a seek from
+ * the end. Load scullc with scullc_stage set for this to test
+ * anything; it says so when staging is off. Only scull devices will
+ * do: they are emptied by a write-only open.
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#define _GNU_SOURCE /* sched_setaffinity */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "bench.h"
+
+static int count = 10000, max = 512;
+
+/* Each record is filled with a byte from its number, which it starts with */
+static void record(char *rec, int seq, int len)
+{
+	memset(rec, 'a' + seq % 26, len);
+	memcpy(rec, &seq, sizeof(seq));
+}
+
+static void stage_size(void)
+{
+	FILE *f = fopen("/sys/module/scullc/parameters/scullc_stage", "r");
+	int stage = 0;
+
+	if (f) {
+		if (fscanf(f, "%i", &stage) != 1)
+			stage = 0;
+		fclose(f);
+	}
+	if (stage > 0)
+		printf("staging %i bytes per CPU\n", stage);
+	else
+		printf("staging is off: load scullc with scullc_stage=16384 "
+		       "to test it\n");
+}
+
+int main(int argc, char **argv)
+{
+	char *rec, *back;
+	int wfd, rfd, opt, i, n, len, cpus, cpu = 0;
+	off_t end = 0;
+	cpu_set_t set;
+
+	prog = argv[0];
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+		case 'n': count = atoi(optarg); break;
+		case 'r': max = atoi(optarg); break;
+		default: optind = argc; /* force the usage message */
+		}
+	}
+	if (optind != argc - 1 || count <= 0 || max < sizeof(int)) {
+		fprintf(stderr, "%s: Usage \"%s [-n records] "
+			"[-r max-record-size] <scullc>\"\n", prog, prog);
+		exit(1);
+	}
+	rec = malloc(max);
+	back = malloc(max);
+	if (!rec || !back)
+		die("malloc");
+	stage_size();
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	wfd = open(argv[optind], O_WRONLY); /* empty it */
+	if (wfd < 0)
+		die(argv[optind]);
+	close(wfd);
+	wfd = open(argv[optind], O_WRONLY | O_APPEND);
+	rfd = open(argv[optind], O_RDONLY);
+	if (wfd < 0 || rfd < 0)
+		die(argv[optind]);
+
+	srandom(1);
+	for (i = 0; i < count; i++) {
+		/* a different CPU, so a different buffer, every time */
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		sched_setaffinity(0, sizeof(set), &set); /* best effort */
+		cpu = (cpu + 1) % cpus;
+
+		len = sizeof(int) + random() % (max - sizeof(int) + 1);
+		record(rec, i, len);
+		if (write(wfd, rec, len) != len)
+			die("write");
+		end += len;
+
+		n = read(rfd, back, len);
+		if (n < 0)
+			die("read");
+		if (n != len || memcmp(rec, back, len)) {
+			fprintf(stderr, "%s: record %i: wrote %i bytes, read "
+				"back %i%s\n", prog, i, len, n,
+				n == len ? " but different ones" : "");
+			exit(1);
+		}
+		if (lseek(wfd, 0, SEEK_END) != end) {
+			fprintf(stderr, "%s: record %i: the device ends at "
+				"%li, not %li\n", prog, i,
+				(long)lseek(wfd, 0, SEEK_CUR), (long)end);
+			exit(1);
+		}
+	}
+	close(wfd);
+	if (read(rfd, back, max) != 0) {
+		fprintf(stderr, "%s: more data than was written\n", prog);
+		exit(1);
+	}
+	close(rfd);
+	printf("%i records, %li bytes, all read back in place\n", count,
+	       (long)end);
+	return 0;
+}
@@ -28,61 +28,205 @@
 #include <linux/aio.h>
 #include <linux/uaccess.h>
 #include <linux/uio.h>	/* iov_iter* */
+#include <linux/sched/mm.h>	/* mmgrab(), mmget_not_zero() */
+#include <linux/mmu_context.h>	/* use_mm() */
+#include <linux/workqueue.h>
+
+#include "scull-async.h"
 
 
 /*
  * A simple asynchronous I/O implementation.
+ *
+ * The device methods themselves are the plain read() and write()
+ * ones; this file runs them either right away, for synchronous
+ * kiocbs, or later from a work item, completing the kiocb through
+ * ki_complete as soon as the data has moved.
  */
 
+static int scull_async_depth = 256;	/* per-device queue bound */
+module_param(scull_async_depth, int, 0);
+
+static struct workqueue_struct *scull_async_wq;
+
 struct async_work {
-	struct delayed_work work;
+	struct list_head list;
 	struct kiocb *iocb;
-	struct iov_iter *tofrom;
+	struct iov_iter tofrom;    /* our copy: the caller's is on its stack */
+	const void *iov;           /* the segment array behind "tofrom" */
+	struct mm_struct *mm;      /* the user buffers live here */
 };
 
 /*
- * "Complete" an asynchronous operation.
+ * Move the data by calling the fops read/write method once per iovec
+ * segment (and again if it returns short, as scull does at the end of
+ * a quantum). Stop at end-of-file, a hole or an error.
  */
-static void scull_do_deferred_op(struct work_struct *work)
+static ssize_t scull_do_op(struct kiocb *iocb, struct iov_iter *tofrom)
 {
-	struct async_work *stuff = container_of(work, struct async_work, work.work);
-	if( iov_iter_rw(stuff->tofrom) == WRITE ) {
-		generic_file_write_iter(stuff->iocb, stuff->tofrom);
-	} else {
-		generic_file_read_iter(stuff->iocb, stuff->tofrom);
+	struct file *filp = iocb->ki_filp;
+	struct iovec iov;
+	ssize_t ret, total = 0;
+
+	if (!iter_is_iovec(tofrom))
+		return -EINVAL;
+
+	while (iov_iter_count(tofrom)) {
+		iov = iov_iter_iovec(tofrom);
+		if (iov_iter_rw(tofrom) == WRITE)
+			ret = filp->f_op->write(filp, iov.iov_base, iov.iov_len,
+					&iocb->ki_pos);
+		else
+			ret = filp->f_op->read(filp, iov.iov_base, iov.iov_len,
+					&iocb->ki_pos);
+		if (ret <= 0) {
+			if (!total)
+				total = ret;
+			break;
+		}
+		total += ret;
+		iov_iter_advance(tofrom, ret);
 	}
+	return total;
+}
+
+/*
+ * "Complete" an asynchronous operation, borrowing the submitter's
+ * address space so that the user buffers can be reached.
+ */
+static void scull_do_deferred_op(struct async_work *stuff)
+{
+	ssize_t ret = -EFAULT; /* the submitter is gone */
+	mm_segment_t old_fs;
+
+	if (mmget_not_zero(stuff->mm)) {
+		use_mm(stuff->mm);
+		old_fs = get_fs(); /* workers may run with KERNEL_DS */
+		set_fs(USER_DS);
+		ret = scull_do_op(stuff->iocb, &stuff->tofrom);
+		set_fs(old_fs);
+		unuse_mm(stuff->mm);
+		mmput(stuff->mm);
+	}
+	stuff->iocb->ki_complete(stuff->iocb, ret, 0);
+	mmdrop(stuff->mm);
+	kfree(stuff->iov);
 	kfree(stuff);
 }
 
+/*
+ * The work function: take everything pending in one go, then run and
+ * complete the whole batch. New submissions requeue the work item.
+ */
+static void scull_async_work(struct work_struct *work)
+{
+	struct scull_async_queue *q =
+		container_of(work, struct scull_async_queue, work);
+	struct async_work *stuff, *next;
+	LIST_HEAD(batch);
+	int n = 0;
+
+	spin_lock(&q->lock);
+	list_splice_init(&q->pending, &batch);
+	spin_unlock(&q->lock);
 
-static int scull_defer_op(struct kiocb *iocb, struct iov_iter *tofrom)
+	list_for_each_entry_safe(stuff, next, &batch, list) {
+		list_del(&stuff->list);
+		scull_do_deferred_op(stuff);
+		n++;
+	}
+
+	spin_lock(&q->lock);
+	q->depth -= n;
+	spin_unlock(&q->lock);
+}
+
+
+static ssize_t scull_defer_op(struct scull_async_queue *q,
+		struct kiocb *iocb, struct iov_iter *tofrom)
 {
 	struct async_work *stuff;
-	int result;
-	/* Otherwise defer the completion for a few milliseconds. */
-	stuff = kmalloc (sizeof (*stuff), GFP_KERNEL);
+
+	/* Kernel threads have no user buffers to come back to */
+	if (!current->mm)
+		return scull_do_op(iocb, tofrom);
+
+	stuff = kmalloc(sizeof(*stuff), GFP_KERNEL);
 	if (stuff == NULL)
-		return result; /* No memory, just complete now */
+		return scull_do_op(iocb, tofrom); /* No memory, just complete now */
+	stuff->iov = dup_iter(&stuff->tofrom, tofrom, GFP_KERNEL);
+	if (stuff->iov == NULL) {
+		kfree(stuff);
+		return scull_do_op(iocb, tofrom);
+	}
 	stuff->iocb = iocb;
-	INIT_DELAYED_WORK(&stuff->work, scull_do_deferred_op);
-	schedule_delayed_work(&stuff->work, HZ/100);
+	stuff->mm = current->mm;
+
+	spin_lock(&q->lock);
+	if (q->depth >= scull_async_depth) {
+		/* Queue full: don't make the caller wait, do it now */
+		spin_unlock(&q->lock);
+		kfree(stuff->iov);
+		kfree(stuff);
+		return scull_do_op(iocb, tofrom);
+	}
+	mmgrab(stuff->mm);
+	list_add_tail(&stuff->list, &q->pending);
+	q->depth++;
+	spin_unlock(&q->lock);
+
+	queue_work(scull_async_wq, &q->work);
 	return -EIOCBQUEUED;
 }
 
 
-ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+ssize_t scull_async_read_iter(struct scull_async_queue *q,
+		struct kiocb *iocb, struct iov_iter *to)
 {
 	/* If this is a synchronous IOCB, we return our status now. */
-	if (is_sync_kiocb(iocb)) {
-		return generic_file_read_iter(iocb,to);
-	}
-	return scull_defer_op(iocb, to);
+	if (is_sync_kiocb(iocb))
+		return scull_do_op(iocb, to);
+	return scull_defer_op(q, iocb, to);
 }
 
-ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+ssize_t scull_async_write_iter(struct scull_async_queue *q,
+		struct kiocb *iocb, struct iov_iter *from)
 {
-	if (is_sync_kiocb(iocb)) {
-		return generic_file_write_iter(iocb,from);
-	}
-	return scull_defer_op(iocb, from);
+	if (is_sync_kiocb(iocb))
+		return scull_do_op(iocb, from);
+	return scull_defer_op(q, iocb, from);
+}
+
+
+void scull_async_init_queue(struct scull_async_queue *q)
+{
+	spin_lock_init(&q->lock);
+	INIT_LIST_HEAD(&q->pending);
+	q->depth = 0;
+	INIT_WORK(&q->work, scull_async_work);
+}
+
+/* Wait until everything submitted to this device has completed */
+void scull_async_flush_queue(struct scull_async_queue *q)
+{
+	flush_work(&q->work);
+}
+
+/*
+ * One unbound workqueue per module: requests run on whatever CPU is
+ * free rather than queueing behind the submitter's per-cpu worker.
+ */
+int scull_async_init(const char *name)
+{
+	scull_async_wq = alloc_workqueue("%s_aio", WQ_UNBOUND, 0, name);
+	if (!scull_async_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+void scull_async_cleanup(void)
+{
+	if (scull_async_wq)
+		destroy_workqueue(scull_async_wq);
+	scull_async_wq = NULL;
 }
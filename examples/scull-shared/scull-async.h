@@ -17,9 +17,32 @@
 #ifndef SCULL_SHARED_SCULL_ASYNC_H_
 #define SCULL_SHARED_SCULL_ASYNC_H_
 
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
-ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
-ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+/*
+ * Each device has its own submission queue. Requests are appended by
+ * read_iter/write_iter and drained in batches by a work item running
+ * on the module's unbound workqueue; a full queue makes the request
+ * run synchronously instead.
+ */
+struct scull_async_queue {
+	spinlock_t lock;           /* protects the fields below */
+	struct list_head pending;  /* submitted, not yet started */
+	int depth;                 /* requests queued or in progress */
+	struct work_struct work;   /* drains "pending" */
+};
+
+int  scull_async_init(const char *name);
+void scull_async_cleanup(void);
+void scull_async_init_queue(struct scull_async_queue *q);
+void scull_async_flush_queue(struct scull_async_queue *q);
+
+ssize_t scull_async_read_iter(struct scull_async_queue *q,
+		struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_async_write_iter(struct scull_async_queue *q,
+		struct kiocb *iocb, struct iov_iter *from);
 
 
 #endif /* SCULL_SHARED_SCULL_ASYNC_H_ */
@@ -0,0 +1,60 @@
+/*
+ * scull-numa.h -- where the quanta of a device are placed
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ */
+
+#ifndef SCULL_SHARED_SCULL_NUMA_H_
+#define SCULL_SHARED_SCULL_NUMA_H_
+
+#ifdef __KERNEL__
+#include <linux/nodemask.h>
+#include <linux/numa.h>
+#endif
+
+/*
+ * A device's quanta go either where the writing thread runs (the
+ * default, as with a plain allocation), round-robin over the nodes
+ * that have memory, or all to one node, given by a policy that is
+ * not negative. A node that is full makes the allocator fall back
+ * to the others, as usual.
+ */
+#define SCULL_NUMA_LOCAL	(-1)
+#define SCULL_NUMA_INTERLEAVE	(-2)
+
+#ifdef __KERNEL__
+static inline int scull_numa_valid(int policy)
+{
+	if (policy == SCULL_NUMA_LOCAL || policy == SCULL_NUMA_INTERLEAVE)
+		return 1;
+	return policy >= 0 && policy < nr_node_ids
+		&& node_state(policy, N_MEMORY);
+}
+
+/*
+ * The node for the next quantum, or NUMA_NO_NODE to leave it to the
+ * allocator (and the task's memory policy). "next" keeps the place
+ * for interleaving; the caller serializes.
+ */
+static inline int scull_numa_node(int policy, int *next)
+{
+	if (policy >= 0)
+		return policy;
+	if (policy != SCULL_NUMA_INTERLEAVE)
+		return NUMA_NO_NODE;
+	*next = next_node_in(*next, node_states[N_MEMORY]);
+	return *next;
+}
+
+#endif /* __KERNEL__ */
+
+#endif /* SCULL_SHARED_SCULL_NUMA_H_ */
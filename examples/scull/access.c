@@ -81,8 +81,8 @@ static int scull_s_release(struct inode *inode, struct file *filp)
 struct file_operations scull_sngl_fops = {
 	.owner =	THIS_MODULE,
 	.llseek =     	scull_llseek,
-	.read =       	scull_read,
-	.write =      	scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
 	.unlocked_ioctl = scull_ioctl,
 	.open =       	scull_s_open,
 	.release =    	scull_s_release,
@@ -143,8 +143,8 @@ static int scull_u_release(struct inode *inode, struct file *filp)
 struct file_operations scull_user_fops = {
 	.owner =      THIS_MODULE,
 	.llseek =     scull_llseek,
-	.read =       scull_read,
-	.write =      scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
 	.unlocked_ioctl = scull_ioctl,
 	.open =       scull_u_open,
 	.release =    scull_u_release,
@@ -216,8 +216,8 @@ static int scull_w_release(struct inode *inode, struct file *filp)
 struct file_operations scull_wusr_fops = {
 	.owner =      THIS_MODULE,
 	.llseek =     scull_llseek,
-	.read =       scull_read,
-	.write =      scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
 	.unlocked_ioctl = scull_ioctl,
 	.open =       scull_w_open,
 	.release =    scull_w_release,
@@ -264,7 +264,8 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key)
 	memset(lptr, 0, sizeof(struct scull_listitem));
 	lptr->key = key;
 	scull_trim(&(lptr->device)); /* initialize it */
-	mutex_init(&lptr->device.lock);
+	lptr->device.limit = scull_dev_limit;
+	init_rwsem(&lptr->device.lock);
 
 	/* place it in the list */
 	list_add(&lptr->list, &scull_c_list);
@@ -315,8 +316,8 @@ static int scull_c_release(struct inode *inode, struct file *filp)
 struct file_operations scull_priv_fops = {
 	.owner =    THIS_MODULE,
 	.llseek =   scull_llseek,
-	.read =     scull_read,
-	.write =    scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
 	.unlocked_ioctl = scull_ioctl,
 	.open =     scull_c_open,
 	.release =  scull_c_release,
@@ -350,7 +351,8 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 	/* Initialize the device structure */
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
-	mutex_init(&dev->lock);
+	dev->limit = scull_dev_limit;
+	init_rwsem(&dev->lock);
 
 	/* Do the cdev stuff. */
 	cdev_init(&dev->cdev, devinfo->fops);
@@ -398,12 +400,14 @@ void scull_access_cleanup(void)
 		struct scull_dev *dev = scull_access_devs[i].sculldev;
 		cdev_del(&dev->cdev);
 		scull_trim(scull_access_devs[i].sculldev);
+		scull_drain_pool(scull_access_devs[i].sculldev);
 	}
 
     	/* And all the cloned devices */
 	list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
 		list_del(&lptr->list);
 		scull_trim(&(lptr->device));
+		scull_drain_pool(&(lptr->device));
 		kfree(lptr);
 	}
 
@@ -20,6 +20,7 @@
 
 #include <linux/kernel.h>	/* printk() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>		/* kvmalloc() */
 #include <linux/fs.h>		/* everything... */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
@@ -27,8 +28,13 @@
 #include <linux/fcntl.h>	/* O_ACCMODE */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/rwsem.h>
+#include <linux/uio.h>		/* iov_iter */
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
 
-#include <linux/uaccess.h>	/* copy_*_user */
+#include <linux/uaccess.h>	/* copy_*_user, pagefault_disable() */
+#include <linux/pagemap.h>	/* fault_in_pages_writeable() */
 
 #include "scull.h"		/* local definitions */
 #include "access_ok_version.h"
@@ -42,46 +48,330 @@ int scull_minor =   0;
 int scull_nr_devs = SCULL_NR_DEVS;	/* number of bare scull devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset =    SCULL_QSET;
+int scull_pool =    SCULL_POOL;	/* free quanta kept by each device */
+int scull_append_max = SCULL_APPEND_MAX; /* appends that are all or nothing */
+long scull_limit =  0;	/* bytes of data all devices may hold, 0: no limit */
+long scull_dev_limit = 0;	/* and each device, unless told otherwise */
+int scull_pages =   0;	/* quanta are whole pages, and can be mapped */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_pool, int, S_IRUGO | S_IWUSR);
+module_param(scull_append_max, int, S_IRUGO | S_IWUSR);
+module_param(scull_limit, long, S_IRUGO | S_IWUSR);
+module_param(scull_dev_limit, long, S_IRUGO);
+module_param(scull_pages, int, S_IRUGO);
 
 MODULE_AUTHOR("Alessandro Rubini, Jonathan Corbet");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct scull_dev *scull_devices;	/* allocated in scull_init_module */
 
+/*
+ * Quanta come from a cache of their own, sized for the quantum in use
+ * at load time; a device trimmed after the quantum was changed falls
+ * back to kmalloc. Rather than freeing them, trim keeps up to scull_pool
+ * quanta on a per-device free list, chained through their first word,
+ * so that a device rewritten after each O_WRONLY open gets its memory
+ * back without going through the allocator. The list belongs to the
+ * device, so the device lock covers it, and the counters too.
+ *
+ * With scull_pages set, the quantum is rounded up to a power-of-two
+ * number of pages, and quanta come from the page allocator instead, so
+ * that they can be mapped (see mmap.c). Like in scullp, a multipage
+ * quantum is split, so that each of its pages is counted on its own
+ * when mapped. The pool works the same, for the quantum size of the
+ * load time: scull_cache_size, even if there is no cache.
+ */
+static struct kmem_cache *scull_cache;
+static int scull_cache_size;	/* the quantum it was made for */
+
+/* The quantum for a device starting afresh */
+static int scull_new_quantum_size(void)
+{
+	if (!scull_pages)
+		return scull_quantum;
+	return PAGE_SIZE << get_order(scull_quantum);
+}
+
+static void *scull_new_quantum(int quantum)
+{
+	struct page *page;
+	int order;
+
+	if (!scull_pages) {
+		if (quantum == scull_cache_size)
+			return kmem_cache_alloc(scull_cache, GFP_KERNEL);
+		return kmalloc(quantum, GFP_KERNEL);
+	}
+	/* zeroed, as what was never written may be mapped */
+	order = get_order(quantum);
+	page = alloc_pages(GFP_KERNEL | __GFP_ZERO, order);
+	if (!page)
+		return NULL;
+	if (order)
+		split_page(page, order);
+	return page_address(page);
+}
 
 /*
- * Empty out the scull device; must be called with the device
- * semaphore held.
+ * The quanta holding data are charged to their device, in bytes, and
+ * to scull_used for all of them; pooled ones are not, as the pool is
+ * bounded anyway and given back under memory pressure.
  */
-int scull_trim(struct scull_dev *dev)
+static atomic_long_t scull_used = ATOMIC_LONG_INIT(0);
+
+static void scull_uncharge(struct scull_dev *dev, unsigned long bytes)
+{
+	dev->used -= bytes;
+	atomic_long_sub(bytes, &scull_used);
+}
+
+static void *scull_get_quantum(struct scull_dev *dev)
+{
+	void *q;
+
+	if (dev->quantum == scull_cache_size && dev->pool) {
+		q = dev->pool;
+		dev->pool = *(void **)q;
+		/*
+		 * Not for users to see: in page mode the whole quantum
+		 * goes, like a fresh one, as what was never written may
+		 * be mapped and read.
+		 */
+		if (scull_pages)
+			memset(q, 0, dev->quantum);
+		else
+			*(void **)q = NULL;
+		dev->pooled--;
+		dev->recycled++;
+		return q;
+	}
+	q = scull_new_quantum(dev->quantum);
+	if (q)
+		dev->allocs++;
+	return q;
+}
+
+static void scull_free_quantum(void *q, int quantum)
 {
-	struct scull_qset *next, *dptr;
-	int qset = dev->qset;   /* "dev" is not-null */
+	struct page *page;
 	int i;
 
-	for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
+	if (scull_pages) {
+		page = virt_to_page(q);
+		for (i = 0; i < 1 << get_order(quantum); i++) /* split */
+			__free_page(page + i);
+	} else if (quantum == scull_cache_size)
+		kmem_cache_free(scull_cache, q);
+	else
+		kfree(q);
+}
+
+/* Take a quantum out of the data: pool it if there is room, or free it */
+static void scull_put_quantum(struct scull_dev *dev, void *q)
+{
+	scull_uncharge(dev, dev->quantum);
+	if (dev->quantum == scull_cache_size && dev->pooled < scull_pool
+	    && dev->quantum >= sizeof(void *)) {
+		*(void **)q = dev->pool;
+		dev->pool = q;
+		dev->pooled++;
+		return;
+	}
+	scull_free_quantum(q, dev->quantum);
+	dev->frees++;
+}
+
+/*
+ * Give the pooled quanta back to the cache, for devices going away
+ * (or changing quantum); must be called with the device lock held,
+ * or with no users left.
+ */
+void scull_drain_pool(struct scull_dev *dev)
+{
+	void *q;
+
+	while ((q = dev->pool)) {
+		dev->pool = *(void **)q;
+		scull_free_quantum(q, scull_cache_size);
+		dev->frees++;
+	}
+	dev->pooled = 0;
+}
+
+/*
+ * Move quanta from the device data to the pool, as long as there is
+ * room for them. At most that many slots are looked at, so this is
+ * bounded by the pool size and not by the device size.
+ */
+static void scull_refill_pool(struct scull_dev *dev)
+{
+	int budget = scull_pool - dev->pooled;
+	struct scull_qset *dptr;
+	void **slot;
+	int i, n;
+
+	if (dev->quantum != scull_cache_size || dev->quantum < sizeof(void *))
+		return;
+	for (n = 0; n < dev->nr_qsets && budget > 0; n++) {
+		dptr = dev->qsets[n];
+		if (!dptr || !dptr->data)
+			continue;
+		for (i = 0; i < dev->qset && budget > 0; i++, budget--) {
+			slot = dptr->data + i;
+			if (!*slot)
+				continue;
+			*(void **)*slot = dev->pool;
+			dev->pool = *slot;
+			dev->pooled++;
+			*slot = NULL;
+			scull_uncharge(dev, dev->quantum);
+		}
+	}
+}
+
+/*
+ * Free a detached index with all it holds; return how many quanta
+ * went back to the allocator.
+ */
+static unsigned long scull_free_data(struct scull_qset **qsets, int nr_qsets,
+		int qset, int quantum)
+{
+	struct scull_qset *dptr;
+	unsigned long freed = 0;
+	int i, n;
+
+	for (n = 0; n < nr_qsets; n++) { /* all the list items */
+		dptr = qsets[n];
+		if (!dptr)
+			continue;
 		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
+			for (i = 0; i < qset; i++) {
+				if (!dptr->data[i])
+					continue;
+				scull_free_quantum(dptr->data[i], quantum);
+				freed++;
+			}
 			kfree(dptr->data);
-			dptr->data = NULL;
 		}
-		next = dptr->next;
 		kfree(dptr);
+		cond_resched(); /* it may be gigabytes */
 	}
+	kvfree(qsets);
+	return freed;
+}
+
+/* Start over with an empty device, after its data has been taken away */
+static void scull_reset(struct scull_dev *dev)
+{
+	scull_uncharge(dev, dev->used);
+	dev->evict = 0;
 	dev->size = 0;
-	dev->quantum = scull_quantum;
+	dev->quantum = scull_new_quantum_size();
 	dev->qset = scull_qset;
-	dev->data = NULL;
+	dev->qsets = NULL;
+	dev->nr_qsets = 0;
+	if (dev->quantum != scull_cache_size) /* pooled ones no longer fit */
+		scull_drain_pool(dev);
+}
+
+/*
+ * Empty out the scull device; must be called with the device
+ * semaphore held. Not while it is mapped, though: the pages must stay.
+ */
+int scull_trim(struct scull_dev *dev)
+{
+	if (atomic_read(&dev->vmas))
+		return -EBUSY;
+	scull_refill_pool(dev);
+	dev->frees += scull_free_data(dev->qsets, dev->nr_qsets, dev->qset,
+			dev->quantum);
+	scull_reset(dev);
 	return 0;
 }
+
+/*
+ * The lazy version, for open: the data is detached from the device, which
+ * is empty right away, and freed later by a worker, so that opening a
+ * device holding gigabytes is no slower than opening an empty one (and
+ * doesn't keep other openers waiting on the lock meanwhile). What the
+ * pool can take is still moved in now, ready for the rewrite. The rest
+ * stays charged, to the device as "trimming" and to scull_used, until
+ * the worker has freed it: otherwise a device reset and refilled over
+ * and over could hold many times its limit.
+ */
+struct scull_trim_work {
+	struct work_struct work;
+	struct scull_dev *dev;
+	struct scull_qset **qsets;
+	int nr_qsets, qset, quantum;
+	unsigned long used;       /* bytes charged for them */
+};
+
+static struct workqueue_struct *scull_trim_wq;
+
+static void scull_trim_worker(struct work_struct *work)
+{
+	struct scull_trim_work *tw = container_of(work, struct scull_trim_work, work);
+	unsigned long freed;
+
+	freed = scull_free_data(tw->qsets, tw->nr_qsets, tw->qset, tw->quantum);
+	down_write(&tw->dev->lock);
+	tw->dev->frees += freed;
+	tw->dev->trimming -= tw->used;
+	atomic_long_sub(tw->used, &scull_used);
+	up_write(&tw->dev->lock);
+	kfree(tw);
+}
+
+/* Must be called with the device semaphore held, like scull_trim */
+static void scull_trim_lazy(struct scull_dev *dev)
+{
+	struct scull_trim_work *tw;
+
+	if (atomic_read(&dev->vmas))
+		return;
+	scull_refill_pool(dev);
+	if (!dev->qsets) {
+		scull_reset(dev);
+		return;
+	}
+	tw = kmalloc(sizeof(*tw), GFP_KERNEL);
+	if (!tw) { /* do it the slow way */
+		scull_trim(dev);
+		return;
+	}
+	INIT_WORK(&tw->work, scull_trim_worker);
+	tw->dev = dev;
+	tw->qsets = dev->qsets;
+	tw->nr_qsets = dev->nr_qsets;
+	tw->qset = dev->qset;
+	tw->quantum = dev->quantum;
+	tw->used = dev->used;
+	dev->trimming += dev->used;
+	dev->used = 0; /* moved, not uncharged */
+	scull_reset(dev);
+	queue_work(scull_trim_wq, &tw->work);
+}
+
 #ifdef SCULL_DEBUG /* use proc only if debugging */
+/*
+ * Index of the last allocated list item, or -1 if there is none
+ */
+static int scull_last_item(struct scull_dev *dev)
+{
+	int n;
+
+	for (n = dev->nr_qsets - 1; n >= 0; n--)
+		if (dev->qsets[n])
+			break;
+	return n;
+}
+
 /*
  * The proc filesystem: function to read and entry
  */
@@ -93,22 +383,32 @@ int scull_read_procmem(struct seq_file *s, void *v)
 
         for (i = 0; i < scull_nr_devs && s->count <= limit; i++) {
                 struct scull_dev *d = &scull_devices[i];
-                struct scull_qset *qs = d->data;
-                if (mutex_lock_interruptible(&d->lock))
+                struct scull_qset *qs;
+                int n, last;
+                if (down_read_killable(&d->lock))
                         return -ERESTARTSYS;
                 seq_printf(s,"\nDevice %i: qset %i, q %i, sz %li\n",
                              i, d->qset, d->quantum, d->size);
-                for (; qs && s->count <= limit; qs = qs->next) { /* scan the list */
-                        seq_printf(s, "  item at %p, qset at %p\n",
-                                     qs, qs->data);
-                        if (qs->data && !qs->next) /* dump only the last item */
+                seq_printf(s, "  quanta: %lu allocated, %lu freed, %lu recycled, %i pooled\n",
+                             d->allocs, d->frees, d->recycled, d->pooled);
+                seq_printf(s, "  memory: %lu used, %li limit%s, %lu evicted\n",
+                             d->used, d->limit, d->cache ? " (cache)" : "",
+                             d->evicted);
+                last = scull_last_item(d);
+                for (n = 0; n <= last && s->count <= limit; n++) { /* scan the index */
+                        qs = d->qsets[n];
+                        if (!qs)
+                                continue;
+                        seq_printf(s, "  item %i at %p, qset at %p\n",
+                                     n, qs, qs->data);
+                        if (qs->data && n == last) /* dump only the last item */
                                 for (j = 0; j < d->qset; j++) {
                                         if (qs->data[j])
                                                 seq_printf(s, "    % 4i: %8p\n",
                                                              j, qs->data[j]);
                                 }
                 }
-                mutex_unlock(&scull_devices[i].lock);
+                up_read(&scull_devices[i].lock);
         }
         return 0;
 }
@@ -143,23 +443,32 @@ static int scull_seq_show(struct seq_file *s, void *v)
 {
 	struct scull_dev *dev = (struct scull_dev *) v;
 	struct scull_qset *d;
-	int i;
+	int i, n, last;
 
-	if (mutex_lock_interruptible(&dev->lock))
+	if (down_read_killable(&dev->lock))
 		return -ERESTARTSYS;
 	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
 			(int) (dev - scull_devices), dev->qset,
 			dev->quantum, dev->size);
-	for (d = dev->data; d; d = d->next) { /* scan the list */
-		seq_printf(s, "  item at %p, qset at %p\n", d, d->data);
-		if (d->data && !d->next) /* dump only the last item */
+	seq_printf(s, "  quanta: %lu allocated, %lu freed, %lu recycled, %i pooled\n",
+			dev->allocs, dev->frees, dev->recycled, dev->pooled);
+	seq_printf(s, "  memory: %lu used, %li limit%s, %lu evicted\n",
+			dev->used, dev->limit, dev->cache ? " (cache)" : "",
+			dev->evicted);
+	last = scull_last_item(dev);
+	for (n = 0; n <= last; n++) { /* scan the index */
+		d = dev->qsets[n];
+		if (!d)
+			continue;
+		seq_printf(s, "  item %i at %p, qset at %p\n", n, d, d->data);
+		if (d->data && n == last) /* dump only the last item */
 			for (i = 0; i < dev->qset; i++) {
 				if (d->data[i])
 					seq_printf(s, "    % 4i: %8p\n",
 							i, d->data[i]);
 			}
 	}
-	mutex_unlock(&dev->lock);
+	up_read(&dev->lock);
 	return 0;
 }
 	
@@ -246,10 +555,10 @@ int scull_open(struct inode *inode, struct file *filp)
 
 	/* now trim to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (mutex_lock_interruptible(&dev->lock))
+		if (down_write_killable(&dev->lock))
 			return -ERESTARTSYS;
-		scull_trim(dev); /* ignore errors */
-		mutex_unlock(&dev->lock);
+		scull_trim_lazy(dev);
+		up_write(&dev->lock);
 	}
 	return 0;          /* success */
 }
@@ -259,133 +568,500 @@ int scull_release(struct inode *inode, struct file *filp)
 	return 0;
 }
 /*
- * Follow the list
+ * Grow the item index so that it has at least "n" slots. The size is
+ * doubled each time, so that appending is amortized constant time.
+ */
+static int scull_grow_index(struct scull_dev *dev, int n)
+{
+	struct scull_qset **qsets;
+	unsigned long nr = dev->nr_qsets ? dev->nr_qsets : 16;
+
+	while (nr < n)
+		nr <<= 1;
+	if (nr > INT_MAX)
+		return -EFBIG;
+	qsets = kvmalloc_array(nr, sizeof(*qsets), GFP_KERNEL);
+	if (!qsets)
+		return -ENOMEM;
+	if (dev->qsets)
+		memcpy(qsets, dev->qsets, dev->nr_qsets * sizeof(*qsets));
+	memset(qsets + dev->nr_qsets, 0, (nr - dev->nr_qsets) * sizeof(*qsets));
+	kvfree(dev->qsets);
+	dev->qsets = qsets;
+	dev->nr_qsets = nr;
+	return 0;
+}
+
+/*
+ * Look up list item "n" without allocating anything: NULL is a hole
+ */
+static struct scull_qset *scull_lookup(struct scull_dev *dev, int n)
+{
+	if (n < 0 || n >= dev->nr_qsets)
+		return NULL;
+	return dev->qsets[n];
+}
+
+/*
+ * Find list item "n", allocating it if need be. Items are indexed
+ * directly, so this no longer walks the list from the head.
  */
 struct scull_qset *scull_follow(struct scull_dev *dev, int n)
 {
-	struct scull_qset *qs = dev->data;
+	struct scull_qset *qs;
+
+	if (n < 0)
+		return NULL;
+	if (n >= dev->nr_qsets && scull_grow_index(dev, n + 1))
+		return NULL;  /* Never mind */
 
-        /* Allocate first qset explicitly if need be */
-	if (! qs) {
-		qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
+	qs = dev->qsets[n];
+	if (!qs) {
+		qs = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
 		if (qs == NULL)
 			return NULL;  /* Never mind */
 		memset(qs, 0, sizeof(struct scull_qset));
-	}
-
-	/* Then follow the list */
-	while (n--) {
-		if (!qs->next) {
-			qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-			if (qs->next == NULL)
-				return NULL;  /* Never mind */
-			memset(qs->next, 0, sizeof(struct scull_qset));
-		}
-		qs = qs->next;
-		continue;
+		dev->qsets[n] = qs;
 	}
 	return qs;
 }
 
 /*
- * Data management: read and write
+ * Find the quantum holding offset "pos" and the offset within it.
+ * scull_quantum_at() only looks; it returns NULL for a hole. The
+ * "alloc" variant fills in the item and quantum if they are missing
+ * and returns an ERR_PTR() if it can't: -ENOMEM, or -ENOSPC when the
+ * device is at its limit; "keep" is where the write started, so that
+ * making room doesn't evict what it just stored.
+ *
+ * Items are numbered with an int, so offsets from INT_MAX items on
+ * can't be stored: there is nothing there to look at, and writing
+ * there fails with -EFBIG.
  */
+static inline int scull_pos_ok(loff_t pos, int itemsize)
+{
+	return pos >= 0 && pos < (loff_t)INT_MAX * itemsize;
+}
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+void *scull_quantum_at(struct scull_dev *dev, loff_t pos, int *q_pos)
 {
-	struct scull_dev *dev = filp->private_data; 
-	struct scull_qset *dptr;	/* the first listitem */
+	struct scull_qset *dptr;
 	int quantum = dev->quantum, qset = dev->qset;
 	int itemsize = quantum * qset; /* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = 0;
+	int item, s_pos, rest;
 
-	if (mutex_lock_interruptible(&dev->lock))
-		return -ERESTARTSYS;
-	if (*f_pos >= dev->size)
-		goto out;
-	if (*f_pos + count > dev->size)
-		count = dev->size - *f_pos;
+	*q_pos = 0;
+	if (!scull_pos_ok(pos, itemsize))
+		return NULL;
 
 	/* find listitem, qset index, and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
+	item = (long)pos / itemsize;
+	rest = (long)pos % itemsize;
+	s_pos = rest / quantum; *q_pos = rest % quantum;
 
-	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scull_follow(dev, item);
+	/* look up the right item; reading never allocates */
+	dptr = scull_lookup(dev, item);
+	if (dptr == NULL || !dptr->data)
+		return NULL;
+	return dptr->data[s_pos];
+}
 
-	if (dptr == NULL || !dptr->data || ! dptr->data[s_pos])
-		goto out; /* don't fill holes */
+/*
+ * Evict the oldest quantum below "below": the first one found from
+ * dev->evict on. Everything under that offset is gone already (a write
+ * that goes there moves it back), so items are freed as it passes their
+ * end. The quantum is pooled for the writer that needs room, or freed
+ * for the shrinker; return 0 if there was none.
+ */
+static int scull_evict(struct scull_dev *dev, loff_t below, int pool)
+{
+	struct scull_qset *dptr;
+	int quantum = dev->quantum, qset = dev->qset;
+	int itemsize = quantum * qset;
+	int item, s_pos;
+	void *q = NULL;
+
+	if (atomic_read(&dev->vmas)) /* mapped pages must stay */
+		return 0;
+	below = min_t(loff_t, below, (loff_t)dev->nr_qsets * itemsize);
+	while (!q && dev->evict < below) {
+		item = (long)dev->evict / itemsize;
+		s_pos = (long)dev->evict % itemsize / quantum;
+		dptr = scull_lookup(dev, item);
+		if (!dptr || !dptr->data) { /* a hole as large as the item */
+			dev->evict = (loff_t)(item + 1) * itemsize;
+			continue;
+		}
+		q = dptr->data[s_pos];
+		dptr->data[s_pos] = NULL;
+		dev->evict += quantum;
+		if (s_pos == qset - 1) { /* the item is empty now */
+			kfree(dptr->data);
+			kfree(dptr);
+			dev->qsets[item] = NULL;
+		}
+	}
+	if (!q)
+		return 0;
+	if (pool)
+		scull_put_quantum(dev, q);
+	else {
+		scull_uncharge(dev, quantum);
+		scull_free_quantum(q, quantum);
+		dev->frees++;
+	}
+	dev->evicted++;
+	return 1;
+}
+
+/*
+ * Charge one more quantum to the device, within its limit and the
+ * global one. A cache makes room by evicting what lies below "keep",
+ * where the current write started; anything else gets -ENOSPC. Data
+ * still being freed after a trim counts too, so a write right after
+ * a lazy trim may find no room until the worker is done.
+ */
+static int scull_charge(struct scull_dev *dev, loff_t keep)
+{
+	long quantum = dev->quantum, limit;
+
+	keep -= (long)keep % quantum;
+	for (;;) {
+		if (!dev->limit
+		    || dev->used + dev->trimming + quantum <= dev->limit) {
+			limit = READ_ONCE(scull_limit);
+			if (atomic_long_add_return(quantum, &scull_used) <= limit
+			    || !limit) {
+				dev->used += quantum;
+				return 0;
+			}
+			atomic_long_sub(quantum, &scull_used);
+		}
+		if (!dev->cache || !scull_evict(dev, keep, 1))
+			return -ENOSPC;
+	}
+}
 
-	/* read only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+/*
+ * The data of cache devices can be dropped when memory is short, and
+ * the pools of all of them. Devices that are busy are skipped, as the
+ * writer may well be the one reclaiming; a rotor spreads the pain.
+ */
+static unsigned long scull_shrink_count(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	struct scull_dev *dev;
+	unsigned long count = 0;
+	int i, quantum;
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
-		goto out;
+	for (i = 0; i < scull_nr_devs; i++) {
+		dev = scull_devices + i;
+		count += READ_ONCE(dev->pooled);
+		quantum = READ_ONCE(dev->quantum);
+		if (READ_ONCE(dev->cache) && quantum > 0)
+			count += READ_ONCE(dev->used) / quantum;
 	}
-	*f_pos += count;
-	retval = count;
+	return count ? count : SHRINK_EMPTY;
+}
 
-  out:
-	mutex_unlock(&dev->lock);
-	return retval;
+static unsigned long scull_shrink_scan(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	static int rotor;
+	struct scull_dev *dev;
+	unsigned long freed = 0;
+	void *q;
+	int i;
+
+	for (i = 0; i < scull_nr_devs && freed < sc->nr_to_scan; i++) {
+		dev = scull_devices + (rotor + i) % scull_nr_devs;
+		if (!down_write_trylock(&dev->lock))
+			continue;
+		for (; freed < sc->nr_to_scan && (q = dev->pool); freed++) {
+			dev->pool = *(void **)q;
+			dev->pooled--;
+			scull_free_quantum(q, scull_cache_size);
+			dev->frees++;
+		}
+		while (dev->cache && freed < sc->nr_to_scan
+		       && scull_evict(dev, LLONG_MAX, 0))
+			freed++;
+		up_write(&dev->lock);
+	}
+	rotor = (rotor + 1) % scull_nr_devs;
+	return freed ? freed : SHRINK_STOP;
 }
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+static struct shrinker scull_shrinker = {
+	.count_objects = scull_shrink_count,
+	.scan_objects = scull_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+static int scull_shrinker_registered;
+
+/*
+ * Set the limit for a device; a cache that holds more than it may now
+ * gives back the difference right away. Anyone who may write the
+ * device may lower its limit, but raising it (or lifting it, with 0)
+ * takes CAP_SYS_RESOURCE, like going past any other resource limit.
+ */
+static int scull_set_limit(struct scull_dev *dev, struct scull_limit *sl)
+{
+	if (sl->limit < 0 || sl->limit > LONG_MAX)
+		return -EINVAL;
+	if (down_write_killable(&dev->lock))
+		return -ERESTARTSYS;
+	if (dev->limit && (!sl->limit || sl->limit > dev->limit)
+	    && !capable(CAP_SYS_RESOURCE)) {
+		up_write(&dev->lock);
+		return -EPERM;
+	}
+	dev->limit = sl->limit;
+	dev->cache = !!sl->cache;
+	while (dev->cache && dev->limit && dev->used > dev->limit
+	       && scull_evict(dev, LLONG_MAX, 0))
+		;
+	up_write(&dev->lock);
+	return 0;
+}
+
+static void *scull_alloc_quantum(struct scull_dev *dev, loff_t pos, int *q_pos,
+		loff_t keep)
 {
-	struct scull_dev *dev = filp->private_data;
 	struct scull_qset *dptr;
 	int quantum = dev->quantum, qset = dev->qset;
 	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
+	int item, s_pos, rest, err;
 
-	if (mutex_lock_interruptible(&dev->lock))
-		return -ERESTARTSYS;
+	if (!scull_pos_ok(pos, itemsize))
+		return ERR_PTR(-EFBIG);
 
 	/* find listitem, qset index and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
+	item = (long)pos / itemsize;
+	rest = (long)pos % itemsize;
+	s_pos = rest / quantum; *q_pos = rest % quantum;
 
-	/* follow the list up to the right position */
+	/* find the right item, allocating it if needed */
 	dptr = scull_follow(dev, item);
 	if (dptr == NULL)
-		goto out;
+		return ERR_PTR(-ENOMEM);
 	if (!dptr->data) {
 		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
 		if (!dptr->data)
-			goto out;
+			return ERR_PTR(-ENOMEM);
 		memset(dptr->data, 0, qset * sizeof(char *));
 	}
+	if (dptr->data[s_pos])
+		return dptr->data[s_pos];
+
+	/* a new one: it must fit in the limits */
+	err = scull_charge(dev, keep);
+	if (err)
+		return ERR_PTR(err);
+	dptr->data[s_pos] = scull_get_quantum(dev);
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
+		scull_uncharge(dev, quantum);
+		return ERR_PTR(-ENOMEM);
 	}
-	/* write only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+	if (pos < dev->evict) /* there is data below it again */
+		dev->evict = pos - *q_pos;
+	return dptr->data[s_pos];
+}
+
+/*
+ * Data management: read and write. These are the iov_iter flavors,
+ * so read(), readv(), preadv2() and io_uring all end up here with the
+ * whole request. Both loop over as many quanta as the request spans,
+ * taking the lock only once. Readers never change the device, so they
+ * share the lock; writers (and trim) take it exclusively.
+ *
+ * The user buffer may be a mapping of this very device, whose fault
+ * handler takes the lock too (see mmap.c): so the copies are made with
+ * page faults disabled, and one that comes out short drops the lock,
+ * faults the buffer in and goes on, like generic_perform_write does.
+ */
+
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scull_dev *dev = iocb->ki_filp->private_data;
+	int quantum, q_pos, err;
+	size_t count, chunk, copied;
+	struct iovec iov;
+	void *qptr;
+	ssize_t retval = 0;
 
-	if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
-		retval = -EFAULT;
+  again:
+	err = 0;
+	if (down_read_killable(&dev->lock))
+		return retval ? retval : -ERESTARTSYS;
+	quantum = dev->quantum; /* under the lock: a reset may change it */
+	count = iov_iter_count(to);
+	if (iocb->ki_pos >= dev->size)
 		goto out;
+	if (iocb->ki_pos + count > dev->size)
+		count = dev->size - iocb->ki_pos;
+
+	while (count) {
+		qptr = scull_quantum_at(dev, iocb->ki_pos, &q_pos);
+
+		/*
+		 * Copy up to the end of this quantum, then move on; the
+		 * iterator takes care of crossing iovec segments. Holes
+		 * read as zeroes, like they do in a sparse file.
+		 */
+		chunk = min(count, (size_t)(quantum - q_pos));
+		pagefault_disable();
+		if (qptr)
+			copied = copy_to_iter(qptr + q_pos, chunk, to);
+		else
+			copied = iov_iter_zero(chunk, to);
+		pagefault_enable();
+		iocb->ki_pos += copied;
+		count -= copied;
+		retval += copied;
+		if (copied < chunk) {
+			err = -EFAULT;
+			break;
+		}
+	}
+
+  out:
+	up_read(&dev->lock);
+	if (err && iter_is_iovec(to)) {
+		iov = iov_iter_iovec(to);
+		if (!fault_in_pages_writeable(iov.iov_base,
+				min_t(size_t, iov.iov_len, PAGE_SIZE)))
+			goto again;
+	}
+	return retval ? retval : err;
+}
+
+/*
+ * Appends (O_APPEND, or RWF_APPEND for pwritev2) start at the end of
+ * the data as it is once we hold the lock, so writers that share
+ * nothing but the device can't overwrite each other. As the whole
+ * request is copied under the lock, it also lands in one piece; and
+ * an append of no more than scull_append_max bytes is all or nothing:
+ * if we run out of memory (or room, see scull_charge) or hit a bad
+ * buffer half way, the size is left alone and the error returned, so
+ * that the next append goes over the torn part and readers never see
+ * it. Bigger ones can come out short, like other writes. An append
+ * whose buffer had to be faulted in is taken back and started over.
+ */
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct scull_dev *dev = iocb->ki_filp->private_data;
+	int quantum, q_pos, record, err;
+	size_t count = iov_iter_count(from), chunk, copied;
+	void *qptr;
+	ssize_t retval = 0;
+	loff_t start;
+
+	record = (iocb->ki_flags & IOCB_APPEND) && count <= scull_append_max;
+  again:
+	err = 0;
+	if (down_write_killable(&dev->lock))
+		return retval ? retval : -ERESTARTSYS;
+	quantum = dev->quantum; /* as in read */
+	if (iocb->ki_flags & IOCB_APPEND)
+		iocb->ki_pos = dev->size;
+	start = iocb->ki_pos;
+
+	while (count) {
+		qptr = scull_alloc_quantum(dev, iocb->ki_pos, &q_pos, start);
+		if (IS_ERR(qptr)) {
+			err = PTR_ERR(qptr);
+			break;
+		}
+
+		/* copy up to the end of this quantum, then move on */
+		chunk = min(count, (size_t)(quantum - q_pos));
+		pagefault_disable();
+		copied = copy_from_iter(qptr + q_pos, chunk, from);
+		pagefault_enable();
+		iocb->ki_pos += copied;
+		count -= copied;
+		retval += copied;
+		if (copied < chunk) {
+			err = -EFAULT;
+			break;
+		}
+	}
+
+	if (record && count) {	/* torn: take it back */
+		iov_iter_revert(from, retval);
+		iocb->ki_pos = start;
+		count += retval;
+		retval = 0;
 	}
-	*f_pos += count;
-	retval = count;
 
         /* update the size */
-	if (dev->size < *f_pos)
-		dev->size = *f_pos;
+	if (dev->size < iocb->ki_pos)
+		dev->size = iocb->ki_pos;
 
-  out:
-	mutex_unlock(&dev->lock);
-	return retval;
+	up_write(&dev->lock);
+	if (err == -EFAULT && !iov_iter_fault_in_readable(from, count))
+		goto again;
+	return retval ? retval : err;
+}
+
+/*
+ * Punch a hole: quanta wholly inside the range are freed (or pooled),
+ * and so are items left with nothing in them; the ends of the range
+ * that only cover part of a quantum are zeroed. The size stays, so
+ * the range then reads back as zeroes and SEEK_DATA skips it.
+ */
+static int scull_punch_hole(struct scull_dev *dev, loff_t offset, loff_t len)
+{
+	struct scull_qset *dptr;
+	int quantum, qset, itemsize;
+	int item, rest, s_pos, q_pos, chunk;
+	loff_t pos, end, istart;
+
+	if (offset < 0 || len <= 0 || offset > LLONG_MAX - len)
+		return -EINVAL;
+	if (down_write_killable(&dev->lock))
+		return -ERESTARTSYS;
+	if (atomic_read(&dev->vmas)) {
+		up_write(&dev->lock);
+		return -EBUSY;
+	}
+	quantum = dev->quantum;
+	qset = dev->qset;
+	itemsize = quantum * qset;
+	end = min_t(loff_t, offset + len, dev->size);
+
+	for (pos = offset; pos < end; ) {
+		item = (long)pos / itemsize;
+		rest = (long)pos % itemsize;
+		istart = (loff_t)item * itemsize;
+		dptr = scull_lookup(dev, item);
+		if (!dptr || !dptr->data) { /* nothing here already */
+			pos = istart + itemsize;
+			continue;
+		}
+		for (; pos < end && pos < istart + itemsize; pos += chunk) {
+			s_pos = rest / quantum;
+			q_pos = rest % quantum;
+			chunk = min_t(loff_t, end - pos, quantum - q_pos);
+			rest += chunk;
+			if (!dptr->data[s_pos])
+				continue;
+			if (chunk == quantum) {
+				scull_put_quantum(dev, dptr->data[s_pos]);
+				dptr->data[s_pos] = NULL;
+			} else
+				memset(dptr->data[s_pos] + q_pos, 0, chunk);
+		}
+		if (offset <= istart && pos == istart + itemsize) {
+			/* the whole item went */
+			kfree(dptr->data);
+			kfree(dptr);
+			dev->qsets[item] = NULL;
+		}
+	}
+	up_write(&dev->lock);
+	return 0;
 }
 
 /*
@@ -500,13 +1176,58 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
          * write less code. Actually, it's the same driver, isn't it?
          */
 
-	  case SCULL_P_IOCTSIZE:
-		scull_p_buffer = arg;
+	  case SCULL_P_IOCTSIZE: /* for every pipe opened from now on */
+		if (! capable (CAP_SYS_ADMIN))
+			return -EPERM;
+		if (arg < 2 || arg > READ_ONCE(scull_p_max_buffer))
+			return -EINVAL;
+		WRITE_ONCE(scull_p_buffer, arg);
 		break;
 
 	  case SCULL_P_IOCQSIZE:
 		return scull_p_buffer;
 
+	  case SCULL_IOCPUNCH: /* only for the scull_dev flavors */
+	  {
+		struct scull_punch punch;
+		struct scull_dev *dev = filp->private_data;
+
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&punch, (void __user *)arg, sizeof(punch)))
+			return -EFAULT;
+		return scull_punch_hole(dev, punch.offset, punch.len);
+	  }
+
+	  case SCULL_IOCSLIMIT: /* these two as well */
+	  {
+		struct scull_limit sl;
+
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&sl, (void __user *)arg, sizeof(sl)))
+			return -EFAULT;
+		return scull_set_limit(filp->private_data, &sl);
+	  }
+
+	  case SCULL_IOCGLIMIT:
+	  {
+		struct scull_limit sl;
+		struct scull_dev *dev = filp->private_data;
+
+		memset(&sl, 0, sizeof(sl));
+		if (down_read_killable(&dev->lock))
+			return -ERESTARTSYS;
+		sl.limit = dev->limit;
+		sl.used = dev->used;
+		sl.cache = dev->cache;
+		up_read(&dev->lock);
+		sl.total = atomic_long_read(&scull_used);
+		if (copy_to_user((void __user *)arg, &sl, sizeof(sl)))
+			return -EFAULT;
+		return 0;
+	  }
+
 
 	  default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
@@ -518,9 +1239,41 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 
 /*
- * The "extended" operations -- only seek
+ * The "extended" operations -- only seek, with SEEK_DATA and SEEK_HOLE
  */
 
+/*
+ * Find the first offset at or after "pos" that is data (a quantum is
+ * there) or a hole (it isn't), going a whole item at a time across
+ * missing items. The end of the device counts as a hole; past it
+ * there is neither, and lseek says -ENXIO.
+ */
+static loff_t scull_seek_data(struct scull_dev *dev, loff_t pos, int hole)
+{
+	struct scull_qset *dptr;
+	int quantum = dev->quantum, qset = dev->qset;
+	int itemsize = quantum * qset;
+	int item, rest;
+
+	if (pos < 0 || pos >= dev->size)
+		return -ENXIO;
+	while (pos < dev->size) {
+		item = (long)pos / itemsize;
+		rest = (long)pos % itemsize;
+		dptr = scull_lookup(dev, item);
+		if (!dptr || !dptr->data) { /* a hole as large as the item */
+			if (hole)
+				return pos;
+			pos = (loff_t)(item + 1) * itemsize;
+			continue;
+		}
+		if (!dptr->data[rest / quantum] == hole)
+			return pos;
+		pos += quantum - rest % quantum; /* on to the next quantum */
+	}
+	return hole ? dev->size : -ENXIO;
+}
+
 loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 {
 	struct scull_dev *dev = filp->private_data;
@@ -539,6 +1292,16 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 		newpos = dev->size + off;
 		break;
 
+	  case 3: /* SEEK_DATA */
+	  case 4: /* SEEK_HOLE */
+		if (down_read_killable(&dev->lock))
+			return -ERESTARTSYS;
+		newpos = scull_seek_data(dev, off, whence == SEEK_HOLE);
+		up_read(&dev->lock);
+		if (newpos < 0)
+			return newpos;
+		break;
+
 	  default: /* can't happen */
 		return -EINVAL;
 	}
@@ -552,9 +1315,10 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 struct file_operations scull_fops = {
 	.owner =    THIS_MODULE,
 	.llseek =   scull_llseek,
-	.read =     scull_read,
-	.write =    scull_write,
+	.read_iter = scull_read_iter,
+	.write_iter = scull_write_iter,
 	.unlocked_ioctl = scull_ioctl,
+	.mmap =     scull_mmap,
 	.open =     scull_open,
 	.release =  scull_release,
 };
@@ -573,10 +1337,17 @@ void scull_cleanup_module(void)
 	int i;
 	dev_t devno = MKDEV(scull_major, scull_minor);
 
+	/* No more reclaim, then let pending trims finish: they use the devices */
+	if (scull_shrinker_registered)
+		unregister_shrinker(&scull_shrinker);
+	if (scull_trim_wq)
+		destroy_workqueue(scull_trim_wq);
+
 	/* Get rid of our char dev entries */
 	if (scull_devices) {
 		for (i = 0; i < scull_nr_devs; i++) {
 			scull_trim(scull_devices + i);
+			scull_drain_pool(scull_devices + i);
 			cdev_del(&scull_devices[i].cdev);
 		}
 		kfree(scull_devices);
@@ -593,6 +1364,9 @@ void scull_cleanup_module(void)
 	scull_p_cleanup();
 	scull_access_cleanup();
 
+	/* only now is every quantum back */
+	if (scull_cache)
+		kmem_cache_destroy(scull_cache);
 }
 
 
@@ -635,6 +1409,23 @@ int scull_init_module(void)
 		return result;
 	}
 
+	/* the quanta cache, exactly one quantum per object */
+	scull_cache_size = scull_new_quantum_size();
+	if (!scull_pages) {
+		scull_cache = kmem_cache_create("scull", scull_quantum, 0, 0,
+				NULL);
+		if (!scull_cache) {
+			result = -ENOMEM;
+			goto fail;
+		}
+	}
+
+	scull_trim_wq = alloc_workqueue("scull_trim", WQ_UNBOUND, 0);
+	if (!scull_trim_wq) {
+		result = -ENOMEM;
+		goto fail;
+	}
+
         /* 
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time
@@ -648,12 +1439,19 @@ int scull_init_module(void)
 
         /* Initialize each device. */
 	for (i = 0; i < scull_nr_devs; i++) {
-		scull_devices[i].quantum = scull_quantum;
+		scull_devices[i].quantum = scull_cache_size;
 		scull_devices[i].qset = scull_qset;
-		mutex_init(&scull_devices[i].lock);
+		scull_devices[i].limit = scull_dev_limit;
+		init_rwsem(&scull_devices[i].lock);
 		scull_setup_cdev(&scull_devices[i], i);
 	}
 
+	/* without it, caches only shrink when written to */
+	if (register_shrinker(&scull_shrinker) == 0)
+		scull_shrinker_registered = 1;
+	else
+		printk(KERN_WARNING "scull: can't register the shrinker\n");
+
         /* At this point call the init function for any friend device */
 	dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
 	dev += scull_p_init(dev);
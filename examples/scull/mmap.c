@@ -0,0 +1,157 @@
+/*  -*- C -*-
+ * mmap.c -- memory mapping for the bare scull devices
+ *
+ * Copyright (C) 2001 Alessandro Rubini and Jonathan Corbet
+ * Copyright (C) 2001 O'Reilly & Associates
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  The citation
+ * should list that the code comes from the book "Linux Device
+ * Drivers" by Alessandro Rubini and Jonathan Corbet, published
+ * by O'Reilly & Associates.   No warranty is attached;
+ * we cannot take responsibility for errors or fitness for use.
+ *
+ */
+
+#include <linux/module.h>
+
+#include <linux/mm.h>		/* everything */
+#include <linux/errno.h>	/* error codes */
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/rwsem.h>
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * Only devices loaded with scull_pages set can be mapped: their quanta
+ * are whole pages from the page allocator, while the usual ones are
+ * 4000 bytes from a slab cache. The mapping shows the quanta themselves,
+ * so stores through a shared one change the data in place, but it
+ * doesn't make the device any larger. Holes and what lies past the end
+ * give a SIGBUS. While the device is mapped, trimming, punching holes
+ * and eviction leave its data alone (see main.c), like scullp does.
+ */
+
+/*
+ * open and close: just keep track of how many times the device is
+ * mapped, to avoid releasing it. They run under the mmap semaphore of
+ * whatever process it is, not the device lock, hence the atomic.
+ */
+
+static void scull_vma_open(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->vmas);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->vmas);
+}
+
+/*
+ * Find the page at "pgoff" in the device, or NULL for holes and past
+ * the end. The quantum is a multiple of the page size, so the page
+ * starts where the offset in the quantum says. Called with the device
+ * lock held.
+ */
+static struct page *scull_find_page(struct scull_dev *dev, pgoff_t pgoff)
+{
+	void *qptr;
+	int q_pos;
+
+	if (pgoff >= (dev->size + PAGE_SIZE - 1) >> PAGE_SHIFT)
+		return NULL; /* out of range */
+	qptr = scull_quantum_at(dev, (loff_t)pgoff << PAGE_SHIFT, &q_pos);
+	if (!qptr)
+		return NULL;
+	return virt_to_page(qptr + q_pos);
+}
+
+/*
+ * Fault-around, done by hand: a read fault maps the resident pages in
+ * the SCULL_AROUND-page block around the faulting one too, so that a
+ * scan takes one fault every few pages rather than one per page.
+ * vm_insert_page counts each page as the fault method does; the area
+ * is VM_MIXEDMAP for it. The core's map_pages method would do the
+ * same, but it may be called with the page table locked, where we
+ * can't take the device lock. Called with the device lock held.
+ */
+#define SCULL_AROUND 16		/* pages, 64kB like the core's default */
+
+static void scull_fault_around(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct scull_dev *dev = vma->vm_private_data;
+	struct page *page;
+	pgoff_t pgoff, start, end;
+
+	start = max(vmf->pgoff & ~(pgoff_t)(SCULL_AROUND - 1), vma->vm_pgoff);
+	end = min(vmf->pgoff | (SCULL_AROUND - 1),
+			vma->vm_pgoff + vma_pages(vma) - 1);
+	for (pgoff = start; pgoff <= end; pgoff++) {
+		if (pgoff == vmf->pgoff)
+			continue;
+		page = scull_find_page(dev, pgoff);
+		if (!page) {
+			if (pgoff << PAGE_SHIFT >= dev->size)
+				break; /* nothing more after the end */
+			continue;
+		}
+		vm_insert_page(vma, vma->vm_start +
+				((pgoff - vma->vm_pgoff) << PAGE_SHIFT), page);
+	}
+}
+
+/*
+ * The fault method retrieves the page required from the device and
+ * returns it to the user. The count for the page must be incremented,
+ * because it is automatically decremented at page unmap. The lock is
+ * safe to take: read and write never fault on a user buffer while
+ * they hold it (see main.c), even when that buffer is this mapping.
+ */
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct scull_dev *dev = vma->vm_private_data;
+	struct page *page;
+	vm_fault_t retval = VM_FAULT_SIGBUS;
+
+	down_read(&dev->lock);
+	page = scull_find_page(dev, vmf->pgoff);
+	if (page) {
+		get_page(page);
+		vmf->page = page;
+		retval = 0;
+		if (!(vmf->flags & FAULT_FLAG_WRITE))
+			scull_fault_around(vmf);
+	}
+	up_read(&dev->lock);
+	return retval;
+}
+
+static struct vm_operations_struct scull_vm_ops = {
+	.open =      scull_vma_open,
+	.close =     scull_vma_close,
+	.fault =     scull_vma_fault,
+};
+
+int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = filp->private_data;
+
+	if (!scull_pages)
+		return -ENODEV;
+
+	/* nothing else to do here: the fault method maps the pages */
+	vma->vm_flags |= VM_MIXEDMAP;
+	vma->vm_ops = &scull_vm_ops;
+	vma->vm_private_data = dev;
+	scull_vma_open(vma);
+	return 0;
+}
@@ -19,6 +19,10 @@
 
 #include <linux/kernel.h>	/* printk(), min() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>		/* kvmalloc() */
+#include <linux/vmalloc.h>	/* vmalloc_user() */
+#include <linux/capability.h>
+#include <linux/uio.h>		/* iov_iter */
 #include <linux/fs.h>		/* everything... */
 #include <linux/proc_fs.h>
 #include <linux/errno.h>	/* error codes */
@@ -35,27 +39,127 @@
 
 struct scull_pipe {
         wait_queue_head_t inq, outq;       /* read and write queues */
-        char *buffer, *end;                /* begin of buf, end of buf */
-        int buffersize;                    /* used in pointer arithmetic */
-        char *rp, *wp;                     /* where to read, where to write */
+        char *buffer;                      /* begin of buf */
+        int buffersize;                    /* used in index arithmetic */
+        struct scull_p_ring *ring;         /* rp and wp, in a page of their own */
+        int mappable;                      /* buffer is from vmalloc_user() */
+        atomic_t vmas;                     /* active mappings */
         int nreaders, nwriters;            /* number of openings for r/w */
         struct fasync_struct *async_queue; /* asynchronous readers */
-        struct mutex lock;              /* mutual exclusion mutex */
+        struct mutex lock;                 /* open and close */
+        struct mutex rlock, wlock;         /* one reader, one writer at a time */
+        int cast;                          /* broadcast policy, or 0 */
+        int msg;                           /* message mode */
+        struct list_head readers;          /* their scull_p_files, for broadcast */
+        int high, low;                     /* wakeup watermarks, see below */
+        long timeout;                      /* readers' wait limit, in jiffies */
+        struct scull_p_stats stats;        /* wakeups done and avoided */
         struct cdev cdev;                  /* Char device structure */
 };
 
+/*
+ * What each open file has of its own. Only readers use the rest, and
+ * only in broadcast mode; they are on the pipe's list from open to
+ * close, under rlock.
+ */
+struct scull_p_file {
+        struct scull_pipe *dev;
+        int reader;                        /* opened for reading */
+        unsigned int rp;                   /* where this one reads */
+        int gone;                          /* cut off for lagging */
+        unsigned long lost;                /* bytes dropped before it read them */
+        struct list_head list;             /* on dev->readers */
+};
+
+/*
+ * The ring is shared kfifo-style: only readers move rp and only writers
+ * move wp, each publishing its index with a release store after the
+ * data copy and picking up the other side's with an acquire load. A
+ * single reader and a single writer thus never take the same lock;
+ * rlock and wlock only serialize several readers (or writers) among
+ * themselves, so extra openers fall back to taking turns on their side.
+ * Replacing the buffer itself takes both, reader's first.
+ *
+ * Wakeups are batched with two watermarks: writers wake sleeping readers
+ * only once "high" bytes are buffered (or the ring is full), and readers
+ * wake sleeping writers only once no more than "low" are left. A reader
+ * waiting below the high mark looks again after "timeout" on its own,
+ * so a trickle of data is delayed but never stranded. The defaults wake
+ * on every transfer, as a pipe does. Each side counts its wakeups under
+ * its own lock: readers' in wlock, writers' in rlock.
+ *
+ * The two indices live in a page of their own, allocated with the
+ * buffer on first open and kept until the last close, so resizing
+ * never moves them from under a lockless reader. SCULL_P_IOCMAP moves
+ * the data to a buffer that can be mapped as well, and then a process
+ * can map the index page followed by the data, and be the producer or
+ * the consumer of the ring without system calls: it moves its own
+ * index with a release store, as we do. The side that finds the ring
+ * empty (or full) raises its flag in the index page and waits in
+ * poll(); the other one, seeing the flag after moving its index,
+ * clears it and calls SCULL_P_IOCWAKE. We raise the flags too before
+ * sleeping in read() and write(), and clear them on our wakeups, so
+ * either side can be the kernel's. The page is shared, so what we read
+ * from it is checked before it is used as an index: a bad value gets
+ * -EIO, and hurts no one but the pipe's users.
+ *
+ * In broadcast mode (SCULL_P_IOCTCAST) every reader gets all of the
+ * data instead of a share of it: each has its own cursor, in its
+ * scull_p_file, and the ring's rp becomes the tail, where the slowest
+ * of them is. Readers move their own cursor and then the tail, all
+ * under rlock, so the writer side is just as it was: it sees the space
+ * behind the tail. The data is kept once, however many read it. What
+ * happens when the slowest reader holds up the writer is the policy:
+ * with SCULL_P_CAST_BLOCK the writer waits, as it would in a pipe;
+ * with SCULL_P_CAST_DROP the laggards lose their oldest data, and with
+ * SCULL_P_CAST_DISCONNECT they are cut off, their reads failing with
+ * ECONNRESET from then on. Either way the writer never waits for a
+ * reader that isn't running; to move cursors it takes rlock, after
+ * dropping wlock so as to take them in the usual order. A broadcast
+ * pipe can't be mapped: a mapped consumer has no cursor.
+ *
+ * In message mode (SCULL_P_IOCTMSG) the ring holds whole messages, each
+ * an unsigned int length followed by the data, which writers publish
+ * with a single move of wp and readers take with a single move of rp,
+ * so nobody ever sees half of one; drops in broadcast mode skip whole
+ * messages too. SCULL_P_IOCRECV takes several of them in one call.
+ */
+
 /* parameters */
 static int scull_p_nr_devs = SCULL_P_NR_DEVS;	/* number of pipe devices */
 int scull_p_buffer =  SCULL_P_BUFFER;	/* buffer size */
+int scull_p_max_buffer = 1048576;	/* resize limit for unprivileged users */
 dev_t scull_p_devno;			/* Our first device number */
 
 module_param(scull_p_nr_devs, int, 0);	/* FIXME check perms */
 module_param(scull_p_buffer, int, 0);
+module_param(scull_p_max_buffer, int, 0644);
 
 static struct scull_pipe *scull_p_devices;
 
+/* In message mode, each message is preceded by its length */
+#define SCULL_P_MSGHDR sizeof(unsigned int)
+
 static int scull_p_fasync(int fd, struct file *filp, int mode);
 static int spacefree(struct scull_pipe *dev);
+static unsigned int scull_p_move_tail(struct scull_pipe *dev, unsigned int keep);
+
+/*
+ * Wakeups say what they are about, so that poll and epoll entries that
+ * didn't ask for it are passed over. Writers wake readers after every
+ * write that finds any waiting (watermarks permitting), not only when
+ * the ring stops being empty, so an EPOLLET user that leaves data in
+ * the ring still hears of what comes next.
+ */
+static inline void scull_p_wake_readers(struct scull_pipe *dev)
+{
+	wake_up_interruptible_poll(&dev->inq, EPOLLIN | EPOLLRDNORM);
+}
+
+static inline void scull_p_wake_writers(struct scull_pipe *dev)
+{
+	wake_up_interruptible_poll(&dev->outq, EPOLLOUT | EPOLLWRNORM);
+}
 /*
  * Open and close
  */
@@ -64,23 +168,53 @@ static int spacefree(struct scull_pipe *dev);
 static int scull_p_open(struct inode *inode, struct file *filp)
 {
 	struct scull_pipe *dev;
+	struct scull_p_file *pf;
 
 	dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
-	filp->private_data = dev;
+	pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+	if (!pf)
+		return -ENOMEM;
+	pf->dev = dev;
+	pf->reader = (filp->f_mode & FMODE_READ) != 0;
+	INIT_LIST_HEAD(&pf->list);
+	filp->private_data = pf;
 
-	if (mutex_lock_interruptible(&dev->lock))
+	if (mutex_lock_interruptible(&dev->lock)) {
+		kfree(pf);
 		return -ERESTARTSYS;
+	}
 	if (!dev->buffer) {
-		/* allocate the buffer */
-		dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
-		if (!dev->buffer) {
+		/* allocate the buffer, and the page with the indices */
+		int size = READ_ONCE(scull_p_buffer); /* it may be set meanwhile */
+
+		dev->buffer = kvmalloc(size, GFP_KERNEL);
+		dev->ring = (struct scull_p_ring *)get_zeroed_page(GFP_KERNEL);
+		if (!dev->buffer || !dev->ring) {
+			kvfree(dev->buffer);
+			free_page((unsigned long)dev->ring);
+			dev->buffer = NULL;
+			dev->ring = NULL;
 			mutex_unlock(&dev->lock);
+			kfree(pf);
 			return -ENOMEM;
 		}
+		/*
+		 * Only a new buffer is reset: others may be reading and
+		 * writing this one without the lock. The page comes zeroed,
+		 * so we rd and wr from the beginning.
+		 */
+		dev->buffersize = size;
+		dev->ring->size = size;
+		dev->mappable = 0;
+	}
+
+	/* a new reader of a broadcast starts with what is buffered */
+	if (pf->reader) {
+		mutex_lock(&dev->rlock);
+		pf->rp = dev->ring->rp;
+		list_add_tail(&pf->list, &dev->readers);
+		mutex_unlock(&dev->rlock);
 	}
-	dev->buffersize = scull_p_buffer;
-	dev->end = dev->buffer + dev->buffersize;
-	dev->rp = dev->wp = dev->buffer; /* rd and wr from the beginning */
 
 	/* use f_mode,not  f_flags: it's cleaner (fs/open.c tells why) */
 	if (filp->f_mode & FMODE_READ)
@@ -96,156 +230,520 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 
 static int scull_p_release(struct inode *inode, struct file *filp)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
 
 	/* remove this filp from the asynchronously notified filp's */
 	scull_p_fasync(-1, filp, 0);
 	mutex_lock(&dev->lock);
+	if (pf->reader) {
+		mutex_lock(&dev->rlock);
+		list_del(&pf->list);
+		if (dev->cast) { /* if it was the slowest, the tail moves up */
+			scull_p_move_tail(dev, dev->ring->rp);
+			scull_p_wake_writers(dev);
+		}
+		mutex_unlock(&dev->rlock);
+	}
 	if (filp->f_mode & FMODE_READ)
 		dev->nreaders--;
 	if (filp->f_mode & FMODE_WRITE)
 		dev->nwriters--;
 	if (dev->nreaders + dev->nwriters == 0) {
-		kfree(dev->buffer);
-		dev->buffer = NULL; /* the other fields are not checked on open */
+		kvfree(dev->buffer);
+		free_page((unsigned long)dev->ring);
+		dev->buffer = NULL; /* the other fields are reset on open */
+		dev->ring = NULL;
 	}
 	mutex_unlock(&dev->lock);
+	kfree(pf);
 	return 0;
 }
 
 
+/*
+ * Is there anything to read? The acquire pairs with the writer's
+ * release of wp, so the data behind it is visible too. A reader of a
+ * broadcast looks at its own cursor, and one that was cut off has its
+ * error to read.
+ */
+static inline int scull_p_readable(struct scull_p_file *pf)
+{
+	struct scull_pipe *dev = pf->dev;
+
+	if (pf->reader && READ_ONCE(dev->cast))
+		return READ_ONCE(pf->gone) ||
+			smp_load_acquire(&dev->ring->wp) != READ_ONCE(pf->rp);
+	return smp_load_acquire(&dev->ring->wp) != READ_ONCE(dev->ring->rp);
+}
+
+/* How much is buffered, given the two pointers */
+static inline unsigned int scull_p_used(struct scull_pipe *dev,
+		unsigned int rp, unsigned int wp)
+{
+	return (wp + dev->buffersize - rp) % dev->buffersize;
+}
+
+/*
+ * Broadcast: move the tail up to the slowest reader still connected,
+ * or to "keep" if there is none, and return it. Cursors only move
+ * towards wp, so the slowest is the one with the most left to read.
+ * Called with rlock held.
+ */
+static unsigned int scull_p_move_tail(struct scull_pipe *dev, unsigned int keep)
+{
+	unsigned int wp = smp_load_acquire(&dev->ring->wp);
+	unsigned int tail = keep, most = 0, used;
+	struct scull_p_file *pf;
+	int found = 0;
+
+	list_for_each_entry(pf, &dev->readers, list) {
+		if (pf->gone)
+			continue;
+		used = scull_p_used(dev, pf->rp, wp);
+		if (!found || used > most) {
+			tail = pf->rp;
+			most = used;
+			found = 1;
+		}
+	}
+	smp_store_release(&dev->ring->rp, tail); /* the space behind is free */
+	return tail;
+}
+
+/* Is this much worth waking readers for? A full ring always is */
+static inline int scull_p_ready(struct scull_pipe *dev, unsigned int used)
+{
+	return used >= min(dev->high, dev->buffersize - 1);
+}
+
+/*
+ * Copy "n" bytes out of the ring, or into it, starting at "pos" and
+ * wrapping at the end. The iov_iter versions return what they copied.
+ */
+static void scull_p_peek(struct scull_pipe *dev, unsigned int pos,
+		void *buf, size_t n)
+{
+	size_t first = min(n, (size_t)(dev->buffersize - pos));
+
+	memcpy(buf, dev->buffer + pos, first);
+	memcpy(buf + first, dev->buffer, n - first);
+}
+
+static void scull_p_poke(struct scull_pipe *dev, unsigned int pos,
+		const void *buf, size_t n)
+{
+	size_t first = min(n, (size_t)(dev->buffersize - pos));
+
+	memcpy(dev->buffer + pos, buf, first);
+	memcpy(dev->buffer, buf + first, n - first);
+}
+
+static size_t scull_p_copy_out(struct scull_pipe *dev, unsigned int pos,
+		struct iov_iter *to, size_t n)
+{
+	size_t first = min(n, (size_t)(dev->buffersize - pos));
+	size_t copied = copy_to_iter(dev->buffer + pos, first, to);
+
+	if (copied == first && n > first)
+		copied += copy_to_iter(dev->buffer, n - first, to);
+	return copied;
+}
+
+static size_t scull_p_copy_in(struct scull_pipe *dev, unsigned int pos,
+		struct iov_iter *from, size_t n)
+{
+	size_t first = min(n, (size_t)(dev->buffersize - pos));
+	size_t copied = copy_from_iter(dev->buffer + pos, first, from);
+
+	if (copied == first && n > first)
+		copied += copy_from_iter(dev->buffer, n - first, from);
+	return copied;
+}
+
 /*
  * Data management: read and write
  */
 
-static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * Wait for something to read. Returns with the read lock held, or with
+ * an error and without it.
+ */
+static int scull_p_wait_data(struct scull_p_file *pf, struct file *filp)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
 
-	if (mutex_lock_interruptible(&dev->lock))
+	if (mutex_lock_interruptible(&dev->rlock))
 		return -ERESTARTSYS;
 
-	while (dev->rp == dev->wp) { /* nothing to read */
-		mutex_unlock(&dev->lock); /* release the lock */
+	while (!scull_p_readable(pf)) { /* nothing to read */
+		mutex_unlock(&dev->rlock); /* release the lock */
 		if (filp->f_flags & O_NONBLOCK)
 			return -EAGAIN;
 		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-		if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
+		WRITE_ONCE(dev->ring->rwait, 1);
+		smp_mb(); /* flag, then wp: a mapped writer does it the other way */
+		if (wait_event_interruptible_timeout(dev->inq,
+				scull_p_readable(pf), READ_ONCE(dev->timeout)) < 0)
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
 		/* otherwise loop, but first reacquire the lock */
-		if (mutex_lock_interruptible(&dev->lock))
+		if (mutex_lock_interruptible(&dev->rlock))
 			return -ERESTARTSYS;
 	}
-	/* ok, data is there, return something */
-	if (dev->wp > dev->rp)
-		count = min(count, (size_t)(dev->wp - dev->rp));
-	else /* the write pointer has wrapped, return data up to dev->end */
-		count = min(count, (size_t)(dev->end - dev->rp));
-	if (copy_to_user(buf, dev->rp, count)) {
-		mutex_unlock (&dev->lock);
-		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Take data out of the ring, now that some is there: all we have,
+ * wrapped or not, or in message mode the next message, of which only
+ * what fits in "to" is copied. Its length goes to *msglen if asked.
+ * Called with the read lock held; returns what was copied.
+ */
+static ssize_t scull_p_take(struct scull_p_file *pf, struct iov_iter *to,
+		unsigned int *msglen)
+{
+	struct scull_pipe *dev = pf->dev;
+	size_t count = iov_iter_count(to), copied;
+	unsigned int *cursor, rp, wp, used, len;
+
+	if (dev->cast && pf->gone)
+		return -ECONNRESET;
+	cursor = dev->cast ? &pf->rp : &dev->ring->rp;
+	rp = READ_ONCE(*cursor);
+	wp = smp_load_acquire(&dev->ring->wp);
+	if (rp >= dev->buffersize || wp >= dev->buffersize) /* mangled */
+		return -EIO;
+	used = scull_p_used(dev, rp, wp);
+	if (dev->msg) {
+		if (used < SCULL_P_MSGHDR)
+			return -EIO;
+		scull_p_peek(dev, rp, &len, SCULL_P_MSGHDR);
+		if (len > used - SCULL_P_MSGHDR)
+			return -EIO;
+		count = min(count, (size_t)len);
+		copied = scull_p_copy_out(dev, (rp + SCULL_P_MSGHDR)
+				% dev->buffersize, to, count);
+		if (count && !copied)
+			return -EFAULT;
+		if (msglen)
+			*msglen = len;
+		len += SCULL_P_MSGHDR; /* the rest is dropped */
+	} else {
+		count = min(count, (size_t)used);
+		copied = scull_p_copy_out(dev, rp, to, count);
+		if (!copied)
+			return -EFAULT;
+		len = copied; /* a fault, or a full pipe when splicing */
+	}
+	rp = (rp + len) % dev->buffersize;
+	smp_store_release(cursor, rp); /* done with the data: hand it back */
+	if (dev->cast) /* but only the slowest reader frees space */
+		rp = scull_p_move_tail(dev, rp);
+
+	/* finally, awake any writers, if enough room is free, and return */
+	if (wq_has_sleeper(&dev->outq)) {
+		if (scull_p_used(dev, rp, wp) <= dev->low) {
+			dev->stats.wwakeups++;
+			WRITE_ONCE(dev->ring->wwait, 0);
+			scull_p_wake_writers(dev);
+		} else
+			dev->stats.wskipped++;
+	}
+	return copied;
+}
+
+static ssize_t scull_p_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	ssize_t result;
+
+	if (!iov_iter_count(to))
+		return 0;
+	result = scull_p_wait_data(pf, filp);
+	if (result)
+		return result;
+	result = scull_p_take(pf, to, NULL);
+	mutex_unlock (&dev->rlock);
+	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)result);
+	return result;
+}
+
+/*
+ * Where a reader at "rp" ends up when it may have no more than "limit"
+ * bytes left to read: in message mode, past whole messages only.
+ */
+static unsigned int scull_p_skip(struct scull_pipe *dev, unsigned int rp,
+		unsigned int wp, unsigned int limit)
+{
+	unsigned int used, len;
+
+	if (!dev->msg)
+		return (wp + dev->buffersize - limit) % dev->buffersize;
+	while ((used = scull_p_used(dev, rp, wp)) > limit) {
+		scull_p_peek(dev, rp, &len, SCULL_P_MSGHDR);
+		if (used < SCULL_P_MSGHDR || len > used - SCULL_P_MSGHDR)
+			return wp; /* mangled: all of it goes */
+		rp = (rp + SCULL_P_MSGHDR + len) % dev->buffersize;
+	}
+	return rp;
+}
+
+/*
+ * Broadcast, not blocking: the readers more than "need" bytes short of
+ * the writer lose their oldest data, or are cut off, and the tail moves
+ * up. With no reader at all, the oldest data just goes. Called with
+ * both locks held.
+ */
+static void scull_p_drop(struct scull_pipe *dev, int need)
+{
+	unsigned int wp = dev->ring->wp, rp = dev->ring->rp;
+	unsigned int limit = dev->buffersize - 1 - need, used, skip;
+	struct scull_p_file *pf;
+	int cut = 0;
+
+	list_for_each_entry(pf, &dev->readers, list) {
+		used = scull_p_used(dev, pf->rp, wp);
+		if (pf->gone || used <= limit)
+			continue;
+		if (dev->cast == SCULL_P_CAST_DROP) {
+			skip = scull_p_skip(dev, pf->rp, wp, limit);
+			pf->lost += used - scull_p_used(dev, skip, wp);
+			WRITE_ONCE(pf->rp, skip);
+		} else {
+			WRITE_ONCE(pf->gone, 1);
+			cut = 1;
+		}
 	}
-	dev->rp += count;
-	if (dev->rp == dev->end)
-		dev->rp = dev->buffer; /* wrapped */
-	mutex_unlock (&dev->lock);
+	if (scull_p_used(dev, rp, wp) > limit)
+		rp = scull_p_skip(dev, rp, wp, limit);
+	scull_p_move_tail(dev, rp);
+	if (cut) /* they have an error to read */
+		wake_up_interruptible_poll(&dev->inq, EPOLLIN | EPOLLERR);
+}
 
-	/* finally, awake any writers and return */
-	wake_up_interruptible(&dev->outq);
-	PDEBUG("\"%s\" did read %li bytes\n",current->comm, (long)count);
-	return count;
+/*
+ * Make room for "need" bytes that way. Called with the write lock held;
+ * it is released to take the read lock first, as everybody does, and
+ * held again on return unless there is an error.
+ */
+static int scull_p_make_room(struct scull_pipe *dev, int need)
+{
+	mutex_unlock(&dev->wlock);
+	if (mutex_lock_interruptible(&dev->rlock))
+		return -ERESTARTSYS;
+	if (mutex_lock_interruptible(&dev->wlock)) {
+		mutex_unlock(&dev->rlock);
+		return -ERESTARTSYS;
+	}
+	if (dev->cast > SCULL_P_CAST_BLOCK) /* it may have changed meanwhile */
+		scull_p_drop(dev, min(need, dev->buffersize - 1));
+	mutex_unlock(&dev->rlock);
+	return 0;
 }
 
-/* Wait for space for writing; caller must hold device semaphore.  On
- * error the semaphore will be released before returning. */
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+/* Wait for "need" bytes of space; caller must hold the write lock.  On
+ * error the lock will be released before returning. */
+static int scull_getwritespace(struct scull_pipe *dev, struct file *filp,
+		int need)
 {
-	while (spacefree(dev) == 0) { /* full */
+	int result;
+
+	while ((result = spacefree(dev)) < min(need, dev->buffersize - 1)) {
 		DEFINE_WAIT(wait);
-		
-		mutex_unlock(&dev->lock);
+
+		if (result < 0) { /* mangled */
+			mutex_unlock(&dev->wlock);
+			return result;
+		}
+		if (dev->cast > SCULL_P_CAST_BLOCK) { /* no waiting for laggards */
+			result = scull_p_make_room(dev, need);
+			if (result)
+				return result;
+			continue;
+		}
+		mutex_unlock(&dev->wlock);
 		if (filp->f_flags & O_NONBLOCK)
 			return -EAGAIN;
 		PDEBUG("\"%s\" writing: going to sleep\n",current->comm);
+		WRITE_ONCE(dev->ring->wwait, 1); /* prepare_to_wait orders it */
 		prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-		if (spacefree(dev) == 0)
+		result = spacefree(dev);
+		if (result >= 0 && result < min(need, dev->buffersize - 1))
 			schedule();
 		finish_wait(&dev->outq, &wait);
 		if (signal_pending(current))
 			return -ERESTARTSYS; /* signal: tell the fs layer to handle it */
-		if (mutex_lock_interruptible(&dev->lock))
+		if (mutex_lock_interruptible(&dev->wlock))
 			return -ERESTARTSYS;
 	}
 	return 0;
 }	
 
-/* How much space is free? */
+/*
+ * How much space is free? The acquire pairs with the reader's release
+ * of rp, so the reader is done with the space we are about to reuse.
+ * Either index may have been mangled through a mapping: that is -EIO,
+ * and with both in range the result is never more than the ring takes.
+ */
 static int spacefree(struct scull_pipe *dev)
 {
-	if (dev->rp == dev->wp)
-		return dev->buffersize - 1;
-	return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+	unsigned int rp = smp_load_acquire(&dev->ring->rp);
+	unsigned int wp = READ_ONCE(dev->ring->wp);
+
+	if (rp >= dev->buffersize || wp >= dev->buffersize)
+		return -EIO;
+	return dev->buffersize - 1 - scull_p_used(dev, rp, wp);
 }
 
-static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/*
+ * Writes follow pipe(7): a blocking writer doesn't return until all of
+ * its data is in the ring, refilling it as the reader drains it, and a
+ * write of up to PIPE_BUF bytes waits until it fits as a whole, so it
+ * is never interleaved with other writers. The ring keeps one byte
+ * free, so if it is smaller than PIPE_BUF that is the atomic limit;
+ * if it shrinks under a waiting writer, the write goes in pieces.
+ * In message mode every write is one message, and waits until all of
+ * it fits; one that never could fails with EMSGSIZE.
+ */
+static ssize_t scull_p_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct scull_pipe *dev = filp->private_data;
-	int result;
+	struct file *filp = iocb->ki_filp;
+	struct scull_pipe *dev = ((struct scull_p_file *)filp->private_data)->dev;
+	size_t count = iov_iter_count(from);
+	size_t chunk, copied;
+	unsigned int rp, wp, space, len, used = 0;
+	ssize_t done = 0;
+	int need, msg, result;
 
-	if (mutex_lock_interruptible(&dev->lock))
+	if (mutex_lock_interruptible(&dev->wlock))
 		return -ERESTARTSYS;
 
-	/* Make sure there's space to write */
-	result = scull_getwritespace(dev, filp);
-	if (result)
-		return result; /* scull_getwritespace called up(&dev->sem) */
-
-	/* ok, space is there, accept something */
-	count = min(count, (size_t)spacefree(dev));
-	if (dev->wp >= dev->rp)
-		count = min(count, (size_t)(dev->end - dev->wp)); /* to end-of-buf */
-	else /* the write pointer has wrapped, fill up to rp-1 */
-		count = min(count, (size_t)(dev->rp - dev->wp - 1));
-	PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-	if (copy_from_user(dev->wp, buf, count)) {
-		mutex_unlock(&dev->lock);
-		return -EFAULT;
+  again:
+	msg = dev->msg;
+	if (msg) {
+		if (count + SCULL_P_MSGHDR > dev->buffersize - 1) {
+			mutex_unlock(&dev->wlock);
+			return -EMSGSIZE;
+		}
+		need = count + SCULL_P_MSGHDR;
+	} else {
+		need = min(dev->buffersize - 1, PIPE_BUF);
+		if (count <= (size_t)need)
+			need = count; /* all at once */
+		else
+			need = 1; /* anything goes */
 	}
-	dev->wp += count;
-	if (dev->wp == dev->end)
-		dev->wp = dev->buffer; /* wrapped */
-	mutex_unlock(&dev->lock);
 
-	/* finally, awake any reader */
-	wake_up_interruptible(&dev->inq);  /* blocked in read() and select() */
+	while (count) {
+		/* Make sure there's space to write */
+		result = scull_getwritespace(dev, filp, need);
+		if (result) /* scull_getwritespace released the lock */
+			return done ? done : result;
+
+		/*
+		 * Take both indices once, and only then check them: what
+		 * is free is worked out from these values, so whatever a
+		 * mapping does to the page now can't make us write more
+		 * than the ring holds.
+		 */
+		rp = smp_load_acquire(&dev->ring->rp);
+		wp = READ_ONCE(dev->ring->wp);
+		if (rp >= dev->buffersize || wp >= dev->buffersize) { /* mangled */
+			mutex_unlock(&dev->wlock);
+			return done ? done : -EIO;
+		}
+		space = dev->buffersize - 1 - scull_p_used(dev, rp, wp);
+		if (dev->msg != msg || (msg && space < need)) {
+			/* the mode, or the ring, changed while we slept */
+			if (!done)
+				goto again;
+			break;
+		}
+
+		/* ok, space is there, accept all it takes, wrapping if needed */
+		if (msg) { /* the data, then its length in front */
+			chunk = count;
+			copied = scull_p_copy_in(dev, (wp + SCULL_P_MSGHDR)
+					% dev->buffersize, from, chunk);
+			if (copied < chunk) { /* no half messages */
+				mutex_unlock(&dev->wlock);
+				return -EFAULT;
+			}
+			len = copied;
+			scull_p_poke(dev, wp, &len, SCULL_P_MSGHDR);
+			wp = (wp + SCULL_P_MSGHDR + copied) % dev->buffersize;
+		} else {
+			chunk = min(count, (size_t)space);
+			PDEBUG("Going to accept %li bytes to %p\n", (long)chunk, dev->buffer + wp);
+			copied = scull_p_copy_in(dev, wp, from, chunk);
+			wp = (wp + copied) % dev->buffersize;
+		}
+		smp_store_release(&dev->ring->wp, wp); /* publish the data */
+
+		/* awake any reader, who makes room for the rest */
+		used = scull_p_used(dev, smp_load_acquire(&dev->ring->rp), wp);
+		if (copied && wq_has_sleeper(&dev->inq)) {
+			if (scull_p_ready(dev, used)) {
+				dev->stats.rwakeups++;
+				WRITE_ONCE(dev->ring->rwait, 0);
+				scull_p_wake_readers(dev);  /* blocked in read() and select() */
+			} else
+				dev->stats.rskipped++;
+		}
+		count -= copied;
+		done += copied;
+		if (copied < chunk) { /* the rest faulted */
+			mutex_unlock(&dev->wlock);
+			return done ? done : -EFAULT;
+		}
+	}
+	mutex_unlock(&dev->wlock);
 
 	/* and signal asynchronous readers, explained late in chapter 5 */
-	if (dev->async_queue)
+	if (dev->async_queue && scull_p_ready(dev, used))
 		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-	PDEBUG("\"%s\" did write %li bytes\n",current->comm, (long)count);
-	return count;
+	PDEBUG("\"%s\" did write %li bytes\n",current->comm, (long)done);
+	return done;
 }
 
-static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
+static __poll_t scull_p_poll(struct file *filp, poll_table *wait)
 {
-	struct scull_pipe *dev = filp->private_data;
-	unsigned int mask = 0;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	__poll_t want = poll_requested_events(wait), mask = 0;
+	int cast = READ_ONCE(dev->cast), space;
 
 	/*
 	 * The buffer is circular; it is considered full
 	 * if "wp" is right behind "rp" and empty if the
-	 * two are equal.
+	 * two are equal. Both are read without a lock,
+	 * like the other side of the read and write paths.
+	 * A broadcast that doesn't block is never full.
+	 * We only wait on the queues of the sides we are
+	 * on and asked about, so an epoll entry for input
+	 * is never on the writers' queue, or the other way
+	 * around. What is asked always has EPOLLERR in it,
+	 * so readers always wait on theirs. A ring whose
+	 * mapped indices are out of range is an error, as
+	 * it is for write.
 	 */
-	mutex_lock(&dev->lock);
-	poll_wait(filp, &dev->inq,  wait);
-	poll_wait(filp, &dev->outq, wait);
-	if (dev->rp != dev->wp)
-		mask |= POLLIN | POLLRDNORM;	/* readable */
-	if (spacefree(dev))
-		mask |= POLLOUT | POLLWRNORM;	/* writable */
-	mutex_unlock(&dev->lock);
+	if ((filp->f_mode & FMODE_READ) && (want & ~(EPOLLOUT | EPOLLWRNORM)))
+		poll_wait(filp, &dev->inq,  wait);
+	if ((filp->f_mode & FMODE_WRITE) && (want & (EPOLLOUT | EPOLLWRNORM)))
+		poll_wait(filp, &dev->outq, wait);
+	if ((filp->f_mode & FMODE_READ) && scull_p_readable(pf))
+		mask |= EPOLLIN | EPOLLRDNORM;	/* readable */
+	if (pf->reader && cast && READ_ONCE(pf->gone))
+		mask |= EPOLLERR;		/* cut off */
+	if (filp->f_mode & FMODE_WRITE) {
+		space = spacefree(dev);
+		if (space < 0)
+			mask |= EPOLLERR;	/* corrupted */
+		else if (space || cast > SCULL_P_CAST_BLOCK)
+			mask |= EPOLLOUT | EPOLLWRNORM;	/* writable */
+	}
 	return mask;
 }
 
@@ -253,9 +751,381 @@ static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 
 
 
+/*
+ * Resize the ring of a live pipe. Both sides are locked out while the
+ * data is moved to the start of the new buffer, so nothing is lost;
+ * shrinking below what's buffered fails with -EBUSY, like it does for
+ * F_SETPIPE_SZ, and so does a ring that is mapped. The new size lasts
+ * until the last close. With "map" set, or if the buffer is mappable
+ * already, the new one is mappable too, which takes vmalloc_user(); a
+ * broadcast can't be made mappable. Readers' cursors move with the data.
+ */
+static int scull_p_resize(struct scull_pipe *dev, unsigned long size, int map)
+{
+	unsigned int rp, wp, used, first;
+	struct scull_p_file *pf;
+	char *buffer;
+	int result = -EBUSY;
+
+	if (size < 2 || size > INT_MAX)
+		return -EINVAL;
+	if (size > scull_p_max_buffer && !capable(CAP_SYS_RESOURCE))
+		return -EPERM;
+
+	if (mutex_lock_interruptible(&dev->rlock))
+		return -ERESTARTSYS;
+	if (mutex_lock_interruptible(&dev->wlock)) {
+		mutex_unlock(&dev->rlock);
+		return -ERESTARTSYS;
+	}
+	if (atomic_read(&dev->vmas) || (map && dev->cast))
+		goto out;
+	map |= dev->mappable; /* we hold both locks: the kind can't change */
+	buffer = map ? vmalloc_user(size) : kvmalloc(size, GFP_KERNEL);
+	result = -ENOMEM;
+	if (!buffer)
+		goto out;
+	rp = dev->ring->rp;
+	wp = dev->ring->wp;
+	used = (wp + dev->buffersize - rp) % dev->buffersize;
+	if (rp >= dev->buffersize || wp >= dev->buffersize)
+		result = -EIO; /* mangled through a mapping */
+	else if (used > size - 1)
+		result = -EBUSY;
+	else
+		result = 0;
+	if (result) {
+		kvfree(buffer);
+		goto out;
+	}
+	first = min(used, dev->buffersize - rp);
+	memcpy(buffer, dev->buffer + rp, first);
+	memcpy(buffer + first, dev->buffer, used - first);
+	list_for_each_entry(pf, &dev->readers, list) /* the data moved under them */
+		pf->rp = scull_p_used(dev, rp, pf->rp);
+	kvfree(dev->buffer);
+	dev->buffer = buffer;
+	dev->buffersize = size;
+	dev->mappable = map;
+	dev->ring->size = size;
+	dev->ring->rp = 0;
+	dev->ring->wp = used;
+  out:
+	mutex_unlock(&dev->wlock);
+	mutex_unlock(&dev->rlock);
+	if (result)
+		return result;
+
+	/* the free space changed, let writers look again */
+	scull_p_wake_writers(dev);
+	return size;
+}
+
+/*
+ * Make the ring mappable, of "size" bytes or as large as it is now,
+ * and return how much to map: the index page, then the data.
+ */
+static long scull_p_map(struct scull_pipe *dev, unsigned long size)
+{
+	int result;
+
+	if (!size)
+		size = READ_ONCE(dev->buffersize);
+	result = scull_p_resize(dev, size, 1);
+	if (result < 0)
+		return result;
+	return PAGE_SIZE + PAGE_ALIGN(size);
+}
+
+/*
+ * Mappings of the ring: the index page goes first, the data follows,
+ * and the whole of both must be mapped, shared. Everything is mapped
+ * right here, so there are no faults to handle; the vma operations
+ * only count the mappings, so that the buffer is not resized from
+ * under them.
+ */
+static void scull_p_vma_open(struct vm_area_struct *vma)
+{
+	struct scull_pipe *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->vmas);
+}
+
+static void scull_p_vma_close(struct vm_area_struct *vma)
+{
+	struct scull_pipe *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->vmas);
+}
+
+static struct vm_operations_struct scull_p_vm_ops = {
+	.open =  scull_p_vma_open,
+	.close = scull_p_vma_close,
+};
+
+static int scull_p_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_pipe *dev = ((struct scull_p_file *)filp->private_data)->dev;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	int result;
+
+	if (vma->vm_pgoff || !(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+	if (mutex_lock_interruptible(&dev->rlock))
+		return -ERESTARTSYS;
+	if (mutex_lock_interruptible(&dev->wlock)) {
+		mutex_unlock(&dev->rlock);
+		return -ERESTARTSYS;
+	}
+	result = -ENODEV; /* SCULL_P_IOCMAP comes first */
+	if (!dev->mappable)
+		goto out;
+	result = -EINVAL;
+	if (len != PAGE_SIZE + PAGE_ALIGN(dev->buffersize))
+		goto out;
+	result = vm_insert_page(vma, vma->vm_start, virt_to_page(dev->ring));
+	if (!result)
+		result = remap_vmalloc_range_partial(vma,
+				vma->vm_start + PAGE_SIZE, dev->buffer,
+				len - PAGE_SIZE);
+	if (!result) {
+		vma->vm_ops = &scull_p_vm_ops;
+		vma->vm_private_data = dev;
+		scull_p_vma_open(vma);
+	}
+  out:
+	mutex_unlock(&dev->wlock);
+	mutex_unlock(&dev->rlock);
+	return result;
+}
+
+/*
+ * Set the watermarks and timeout; both sides are locked out so that
+ * their counters and wakeup decisions see a consistent set.
+ */
+static int scull_p_set_water(struct scull_pipe *dev,
+		struct scull_p_water __user *uwater)
+{
+	struct scull_p_water water;
+
+	if (copy_from_user(&water, uwater, sizeof(water)))
+		return -EFAULT;
+	if (water.high < 1 || water.low < 0 || water.timeout < 0)
+		return -EINVAL;
+	if (mutex_lock_interruptible(&dev->rlock))
+		return -ERESTARTSYS;
+	if (mutex_lock_interruptible(&dev->wlock)) {
+		mutex_unlock(&dev->rlock);
+		return -ERESTARTSYS;
+	}
+	dev->high = water.high;
+	dev->low = water.low;
+	WRITE_ONCE(dev->timeout, water.timeout ? msecs_to_jiffies(water.timeout)
+			: MAX_SCHEDULE_TIMEOUT);
+	mutex_unlock(&dev->wlock);
+	mutex_unlock(&dev->rlock);
+
+	/* sleepers may be past their new marks already */
+	scull_p_wake_readers(dev);
+	scull_p_wake_writers(dev);
+	return 0;
+}
+
+static int scull_p_get_water(struct scull_pipe *dev,
+		struct scull_p_water __user *uwater)
+{
+	struct scull_p_water water;
+	long timeout = READ_ONCE(dev->timeout);
+
+	water.high = READ_ONCE(dev->high);
+	water.low = READ_ONCE(dev->low);
+	water.timeout = timeout == MAX_SCHEDULE_TIMEOUT ? 0
+		: jiffies_to_msecs(timeout);
+	return copy_to_user(uwater, &water, sizeof(water)) ? -EFAULT : 0;
+}
+
+/*
+ * Broadcast, or stop. Readers that join start where the slowest one is
+ * (it's where the tail is); when it stops, they share the ring from
+ * there on. The policy may change on the fly.
+ */
+static int scull_p_set_cast(struct scull_pipe *dev, unsigned long policy)
+{
+	struct scull_p_file *pf;
+	int result = -EBUSY;
+
+	if (policy > SCULL_P_CAST_DISCONNECT)
+		return -EINVAL;
+	if (mutex_lock_interruptible(&dev->rlock))
+		return -ERESTARTSYS;
+	if (mutex_lock_interruptible(&dev->wlock)) {
+		mutex_unlock(&dev->rlock);
+		return -ERESTARTSYS;
+	}
+	if (!dev->mappable) {
+		if (!dev->cast)
+			list_for_each_entry(pf, &dev->readers, list) {
+				WRITE_ONCE(pf->rp, dev->ring->rp);
+				WRITE_ONCE(pf->gone, 0);
+			}
+		WRITE_ONCE(dev->cast, policy);
+		result = 0;
+	}
+	mutex_unlock(&dev->wlock);
+	mutex_unlock(&dev->rlock);
+
+	/* either side may have something to do now */
+	scull_p_wake_readers(dev);
+	scull_p_wake_writers(dev);
+	return result;
+}
+
+/*
+ * Messages or bytes. The two don't mix, so the ring has to be empty.
+ */
+static int scull_p_set_msg(struct scull_pipe *dev, unsigned long msg)
+{
+	int result = -EBUSY;
+
+	if (msg > 1)
+		return -EINVAL;
+	if (mutex_lock_interruptible(&dev->rlock))
+		return -ERESTARTSYS;
+	if (mutex_lock_interruptible(&dev->wlock)) {
+		mutex_unlock(&dev->rlock);
+		return -ERESTARTSYS;
+	}
+	if (dev->ring->rp == dev->ring->wp) {
+		WRITE_ONCE(dev->msg, msg);
+		result = 0;
+	}
+	mutex_unlock(&dev->wlock);
+	mutex_unlock(&dev->rlock);
+	return result;
+}
+
+/*
+ * Take up to recv.count messages, one into each iovec, after waiting
+ * for the first one like read() does, and return how many. Each iovec
+ * is read and used in turn, so there is nothing to allocate.
+ */
+static long scull_p_recv(struct scull_p_file *pf, struct file *filp,
+		struct scull_p_recv __user *urecv)
+{
+	struct scull_pipe *dev = pf->dev;
+	struct scull_p_recv recv;
+	struct iovec iov;
+	struct iov_iter iter;
+	unsigned int len;
+	long result;
+	int n;
+
+	if (!(filp->f_mode & FMODE_READ))
+		return -EBADF;
+	if (copy_from_user(&recv, urecv, sizeof(recv)))
+		return -EFAULT;
+	if (recv.count < 1 || recv.count > UIO_MAXIOV || !READ_ONCE(dev->msg))
+		return -EINVAL;
+	result = scull_p_wait_data(pf, filp);
+	if (result)
+		return result;
+	if (!dev->msg) { /* it changed while we slept */
+		mutex_unlock(&dev->rlock);
+		return -EINVAL;
+	}
+	for (n = 0; n < recv.count && scull_p_readable(pf); n++) {
+		if (copy_from_user(&iov, recv.iov + n, sizeof(iov))) {
+			result = -EFAULT;
+			break;
+		}
+		result = import_single_range(READ, iov.iov_base, iov.iov_len,
+				&iov, &iter);
+		if (result < 0)
+			break;
+		result = scull_p_take(pf, &iter, &len);
+		if (result < 0)
+			break;
+		if (recv.len && put_user(len, recv.len + n)) {
+			result = -EFAULT;
+			n++; /* it's gone anyway */
+			break;
+		}
+	}
+	mutex_unlock(&dev->rlock);
+	return n ? n : result;
+}
+
+/*
+ * The pipe has some commands of its own, the rest are scull's.
+ */
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+
+	switch(cmd) {
+	  case SCULL_P_IOCTRING:
+		return scull_p_resize(dev, arg, 0);
+
+	  case SCULL_P_IOCMAP:
+		return scull_p_map(dev, arg);
+
+	  case SCULL_P_IOCWAKE: /* from the other side of a mapped ring */
+		if (arg & ~(POLLIN | POLLOUT))
+			return -EINVAL;
+		if (arg & POLLIN)
+			scull_p_wake_readers(dev);
+		if (arg & POLLOUT)
+			scull_p_wake_writers(dev);
+		return 0;
+
+	  case SCULL_P_IOCQRING:
+		return READ_ONCE(dev->buffersize);
+
+	  case SCULL_P_IOCSWATER:
+		return scull_p_set_water(dev, (struct scull_p_water __user *)arg);
+
+	  case SCULL_P_IOCGWATER:
+		return scull_p_get_water(dev, (struct scull_p_water __user *)arg);
+
+	  case SCULL_P_IOCGSTATS: /* a snapshot, each field read once */
+		if (copy_to_user((void __user *)arg, &dev->stats, sizeof(dev->stats)))
+			return -EFAULT;
+		return 0;
+
+	  case SCULL_P_IOCTCAST:
+		return scull_p_set_cast(dev, arg);
+
+	  case SCULL_P_IOCQCAST:
+		return READ_ONCE(dev->cast);
+
+	  case SCULL_P_IOCQLOST: /* by this reader, since it opened */
+		return READ_ONCE(pf->lost);
+
+	  case SCULL_P_IOCTMSG:
+		return scull_p_set_msg(dev, arg);
+
+	  case SCULL_P_IOCQMSG:
+		return READ_ONCE(dev->msg);
+
+	  case SCULL_P_IOCRECV:
+		return scull_p_recv(pf, filp, (struct scull_p_recv __user *)arg);
+
+	  case SCULL_IOCPUNCH: /* scull's, but not for pipes */
+	  case SCULL_IOCSLIMIT:
+	  case SCULL_IOCGLIMIT:
+		return -ENOTTY;
+
+	  default:
+		return scull_ioctl(filp, cmd, arg);
+	}
+}
+
+
+
 static int scull_p_fasync(int fd, struct file *filp, int mode)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_pipe *dev = ((struct scull_p_file *)filp->private_data)->dev;
 
 	return fasync_helper(fd, filp, mode, &dev->async_queue);
 }
@@ -278,9 +1148,22 @@ static int scull_read_p_mem(struct seq_file *s, void *v)
 			return -ERESTARTSYS;
 		seq_printf(s, "\nDevice %i: %p\n", i, p);
 /*		seq_printf(s, "   Queues: %p %p\n", p->inq, p->outq);*/
-		seq_printf(s, "   Buffer: %p to %p (%i bytes)\n", p->buffer, p->end, p->buffersize);
-		seq_printf(s, "   rp %p   wp %p\n", p->rp, p->wp);
+		seq_printf(s, "   Buffer: %p (%i bytes)\n", p->buffer, p->buffersize);
+		if (p->ring)
+			seq_printf(s, "   rp %u   wp %u%s\n", READ_ONCE(p->ring->rp),
+					READ_ONCE(p->ring->wp),
+					p->mappable ? "   mappable" : "");
 		seq_printf(s, "   readers %i   writers %i\n", p->nreaders, p->nwriters);
+		if (p->cast)
+			seq_printf(s, "   broadcast, policy %i\n", p->cast);
+		if (p->msg)
+			seq_printf(s, "   messages\n");
+		seq_printf(s, "   high %i   low %i   timeout %li\n", p->high, p->low,
+				p->timeout);
+		seq_printf(s, "   reader wakeups %lu (%lu avoided)\n",
+				p->stats.rwakeups, p->stats.rskipped);
+		seq_printf(s, "   writer wakeups %lu (%lu avoided)\n",
+				p->stats.wwakeups, p->stats.wskipped);
 		mutex_unlock(&p->lock);
 	}
 	return 0;
@@ -310,10 +1193,13 @@ static struct file_operations scullpipe_proc_ops = {
 struct file_operations scull_pipe_fops = {
 	.owner =	THIS_MODULE,
 	.llseek =	no_llseek,
-	.read =		scull_p_read,
-	.write =	scull_p_write,
+	.read_iter =	scull_p_read_iter,
+	.write_iter =	scull_p_write_iter,
+	.splice_read =	generic_file_splice_read,
+	.splice_write =	iter_file_splice_write,
 	.poll =		scull_p_poll,
-	.unlocked_ioctl = scull_ioctl,
+	.unlocked_ioctl = scull_p_ioctl,
+	.mmap =		scull_p_mmap,
 	.open =		scull_p_open,
 	.release =	scull_p_release,
 	.fasync =	scull_p_fasync,
@@ -344,6 +1230,8 @@ int scull_p_init(dev_t firstdev)
 {
 	int i, result;
 
+	if (scull_p_buffer < 2)
+		scull_p_buffer = SCULL_P_BUFFER; /* the ring needs a byte free */
 	result = register_chrdev_region(firstdev, scull_p_nr_devs, "scullp");
 	if (result < 0) {
 		printk(KERN_NOTICE "Unable to get scullp region, error %d\n", result);
@@ -360,6 +1248,12 @@ int scull_p_init(dev_t firstdev)
 		init_waitqueue_head(&(scull_p_devices[i].inq));
 		init_waitqueue_head(&(scull_p_devices[i].outq));
 		mutex_init(&scull_p_devices[i].lock);
+		mutex_init(&scull_p_devices[i].rlock);
+		mutex_init(&scull_p_devices[i].wlock);
+		INIT_LIST_HEAD(&scull_p_devices[i].readers);
+		scull_p_devices[i].high = 1;		/* any data */
+		scull_p_devices[i].low = INT_MAX;	/* any room */
+		scull_p_devices[i].timeout = MAX_SCHEDULE_TIMEOUT;
 		scull_p_setup_cdev(scull_p_devices + i, i);
 	}
 #ifdef SCULL_DEBUG
@@ -385,7 +1279,7 @@ void scull_p_cleanup(void)
 
 	for (i = 0; i < scull_p_nr_devs; i++) {
 		cdev_del(&scull_p_devices[i].cdev);
-		kfree(scull_p_devices[i].buffer);
+		kvfree(scull_p_devices[i].buffer);
 	}
 	kfree(scull_p_devices);
 	unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
@@ -54,10 +54,11 @@
 
 /*
  * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * Use an array of indirect blocks, indexed by item number.
  *
- * "scull_dev->data" points to an array of pointers, each
- * pointer refers to a memory area of SCULL_QUANTUM bytes.
+ * "scull_dev->qsets[n]" points to a quantum set, whose data field
+ * is an array of pointers, each pointer refers to a memory area of
+ * SCULL_QUANTUM bytes.
  *
  * The array (quantum-set) is SCULL_QSET long.
  */
@@ -69,6 +70,20 @@
 #define SCULL_QSET    1000
 #endif
 
+/*
+ * Free quanta a device keeps across trims, 4 MB worth by default
+ */
+#ifndef SCULL_POOL
+#define SCULL_POOL    1000
+#endif
+
+/*
+ * Appends up to this size go in whole or not at all
+ */
+#ifndef SCULL_APPEND_MAX
+#define SCULL_APPEND_MAX 65536
+#endif
+
 /*
  * The pipe device is a simple circular buffer. Here its default size
  */
@@ -76,21 +91,33 @@
 #define SCULL_P_BUFFER 4000
 #endif
 
+#ifdef __KERNEL__ /* the rest is for the driver; the ioctls are for all */
+
 /*
  * Representation of scull quantum sets.
  */
 struct scull_qset {
 	void **data;
-	struct scull_qset *next;
 };
 
 struct scull_dev {
-	struct scull_qset *data;  /* Pointer to first quantum set */
+	struct scull_qset **qsets; /* quantum sets, indexed by item */
+	int nr_qsets;             /* slots allocated in "qsets" */
 	int quantum;              /* the current quantum size */
 	int qset;                 /* the current array size */
 	unsigned long size;       /* amount of data stored here */
 	unsigned int access_key;  /* used by sculluid and scullpriv */
-	struct mutex lock;     /* mutual exclusion semaphore     */
+	void *pool;               /* free quanta, kept for reuse */
+	int pooled;               /* how many of them */
+	unsigned long allocs, frees, recycled; /* quanta usage counts */
+	unsigned long used;       /* bytes in the quanta holding data */
+	unsigned long trimming;   /* and in those still being freed */
+	long limit;               /* how many it may hold, 0 for no limit */
+	int cache;                /* at the limit, evict the oldest data */
+	loff_t evict;             /* no quanta left below this offset */
+	unsigned long evicted;    /* quanta evicted so far */
+	atomic_t vmas;            /* active mappings */
+	struct rw_semaphore lock; /* shared by readers, exclusive to writers */
 	struct cdev cdev;	  /* Char device structure		*/
 };
 
@@ -108,8 +135,14 @@ extern int scull_major;     /* main.c */
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
+extern int scull_pool;
+extern int scull_append_max;
+extern long scull_limit;
+extern long scull_dev_limit;
+extern int scull_pages;
 
 extern int scull_p_buffer;	/* pipe.c */
+extern int scull_p_max_buffer;
 
 
 /*
@@ -122,13 +155,17 @@ int     scull_access_init(dev_t dev);
 void    scull_access_cleanup(void);
 
 int     scull_trim(struct scull_dev *dev);
+void    scull_drain_pool(struct scull_dev *dev);
+struct scull_qset *scull_follow(struct scull_dev *dev, int n);
+void   *scull_quantum_at(struct scull_dev *dev, loff_t pos, int *q_pos);
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-                   loff_t *f_pos);
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-                    loff_t *f_pos);
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
 loff_t  scull_llseek(struct file *filp, loff_t off, int whence);
 long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int     scull_mmap(struct file *filp, struct vm_area_struct *vma);
+
+#endif /* __KERNEL__ */
 
 
 /*
@@ -169,8 +206,119 @@ long     scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+/*
+ * These two act on the ring of the open pipe rather than on the
+ * default for new ones, like F_SETPIPE_SZ and F_GETPIPE_SZ do.
+ */
+#define SCULL_P_IOCTRING _IO(SCULL_IOC_MAGIC,   15)
+#define SCULL_P_IOCQRING _IO(SCULL_IOC_MAGIC,   16)
+
+/*
+ * Wakeup watermarks for a pipe: readers are woken once "high" bytes are
+ * buffered, writers once no more than "low" are; a reader below the
+ * high mark wakes anyway after "timeout" milliseconds (0: never).
+ */
+struct scull_p_water {
+	int high;
+	int low;
+	int timeout;
+};
+
+/* And how many wakeups were done and avoided thanks to them */
+struct scull_p_stats {
+	unsigned long rwakeups, rskipped;
+	unsigned long wwakeups, wskipped;
+};
+
+#define SCULL_P_IOCSWATER _IOW(SCULL_IOC_MAGIC, 17, struct scull_p_water)
+#define SCULL_P_IOCGWATER _IOR(SCULL_IOC_MAGIC, 18, struct scull_p_water)
+#define SCULL_P_IOCGSTATS _IOR(SCULL_IOC_MAGIC, 19, struct scull_p_stats)
+
+/*
+ * Punch a hole in a scull device: the range then reads back as
+ * zeroes and takes no memory, unless it only covers part of a quantum.
+ */
+struct scull_punch {
+	long long offset;
+	long long len;
+};
+
+#define SCULL_IOCPUNCH _IOW(SCULL_IOC_MAGIC, 20, struct scull_punch)
+
+/*
+ * Memory limits. A device may hold "limit" bytes of data (0 for no
+ * limit), and all of them together scull_limit. A write that needs
+ * more fails with ENOSPC, unless the device is a cache: then its
+ * oldest quanta (the lowest offsets, for data that is appended) are
+ * evicted to make room, and read back as a hole. Cache devices are
+ * also evicted from under memory pressure. Raising a limit, or
+ * lifting it, takes CAP_SYS_RESOURCE. "used" and "total" are only
+ * reported, by G.
+ */
+struct scull_limit {
+	long long limit;
+	long long used;		/* by this device */
+	long long total;	/* by all of them */
+	int cache;
+};
+
+#define SCULL_IOCSLIMIT _IOW(SCULL_IOC_MAGIC, 21, struct scull_limit)
+#define SCULL_IOCGLIMIT _IOR(SCULL_IOC_MAGIC, 22, struct scull_limit)
+
+/*
+ * The index page of a pipe, which SCULL_P_IOCMAP makes mappable along
+ * with the data: map what it returns from offset 0, and the data starts
+ * a page in. Each side of the ring moves only its own index, with a
+ * release store, and raises its flag before waiting in poll(); the
+ * other side clears it and calls SCULL_P_IOCWAKE with POLLIN (to wake
+ * readers) or POLLOUT (writers) after moving its index, if it sees it.
+ * The ring is empty when rp == wp and keeps a byte free, as in pipe.c.
+ */
+struct scull_p_ring {
+	unsigned int rp;	/* where to read, moved by the consumer */
+	unsigned int wp;	/* where to write, moved by the producer */
+	unsigned int size;	/* of the data, not to be changed */
+	unsigned int rwait;	/* the consumer waits for data */
+	unsigned int wwait;	/* the producer waits for room */
+};
+
+#define SCULL_P_IOCMAP    _IO(SCULL_IOC_MAGIC,  23)
+#define SCULL_P_IOCWAKE   _IO(SCULL_IOC_MAGIC,  24)
+
+/*
+ * Broadcast mode for a pipe: every reader gets all of the data, and
+ * the policy says what to do when the slowest one holds up the writer
+ * (T sets it, 0 turning broadcast off). QLOST returns how many bytes
+ * the reader calling it has lost to SCULL_P_CAST_DROP.
+ */
+#define SCULL_P_CAST_OFF        0
+#define SCULL_P_CAST_BLOCK      1	/* the writer waits */
+#define SCULL_P_CAST_DROP       2	/* the reader loses the oldest data */
+#define SCULL_P_CAST_DISCONNECT 3	/* the reader gets ECONNRESET */
+
+#define SCULL_P_IOCTCAST  _IO(SCULL_IOC_MAGIC,  25)
+#define SCULL_P_IOCQCAST  _IO(SCULL_IOC_MAGIC,  26)
+#define SCULL_P_IOCQLOST  _IO(SCULL_IOC_MAGIC,  27)
+
+/*
+ * Message mode for a pipe (T 1 to set, 0 for bytes, while it's empty):
+ * each write() is a message, and each read() returns one, cut short if
+ * the buffer is. In the ring, as mapped, a message is its length as an
+ * unsigned int followed by the data. RECV waits for a message, then
+ * takes up to "count" of those there, one into each of the iovecs;
+ * their lengths go to "len" unless it's NULL, and it returns how many.
+ */
+struct scull_p_recv {
+	struct iovec *iov;
+	unsigned int *len;
+	int count;
+};
+
+#define SCULL_P_IOCTMSG   _IO(SCULL_IOC_MAGIC,  28)
+#define SCULL_P_IOCQMSG   _IO(SCULL_IOC_MAGIC,  29)
+#define SCULL_P_IOCRECV   _IOW(SCULL_IOC_MAGIC, 30, struct scull_p_recv)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 30
 
 #endif /* _SCULL_H_ */
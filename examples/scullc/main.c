@@ -20,6 +20,7 @@
 #include <linux/init.h>
 #include <linux/kernel.h>	/* printk() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>		/* page_to_nid() */
 #include <linux/fs.h>		/* everything... */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
@@ -39,11 +40,17 @@ int scullc_major =   SCULLC_MAJOR;
 int scullc_devs =    SCULLC_DEVS;	/* number of bare scullc devices */
 int scullc_qset =    SCULLC_QSET;
 int scullc_quantum = SCULLC_QUANTUM;
+int scullc_numa =    SCULL_NUMA_LOCAL; /* for all devices, at load time */
+int scullc_stage =   SCULLC_STAGE;
+int scullc_stage_ms = SCULLC_STAGE_MS;
 
 module_param(scullc_major, int, 0);
 module_param(scullc_devs, int, 0);
 module_param(scullc_qset, int, 0);
 module_param(scullc_quantum, int, 0);
+module_param(scullc_numa, int, 0);
+module_param(scullc_stage, int, S_IRUGO);
+module_param(scullc_stage_ms, int, S_IRUGO | S_IWUSR);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -51,6 +58,9 @@ struct scullc_dev *scullc_devices; /* allocated in scullc_init */
 
 int scullc_trim(struct scullc_dev *dev);
 void scullc_cleanup(void);
+static void scullc_drop_stage(struct scullc_dev *dev);
+static ssize_t scullc_stage_write(struct scullc_dev *dev,
+		const char __user *buf, size_t count);
 
 /* declare one cache pointer: use it for all devices */
 struct kmem_cache *scullc_cache;
@@ -67,18 +77,33 @@ struct kmem_cache *scullc_cache;
 /* FIXME: Do we need this here??  It be ugly  */
 int scullc_read_procmem(struct seq_file *m, void *v)
 {
-	int i, j, quantum, qset;
+	int i, j, quantum, qset, nid;
 	int limit = m->size - 80; /* Don't print more than this */
 	struct scullc_dev *d;
+	unsigned long *pernode;
 
+	pernode = kcalloc(nr_node_ids, sizeof(*pernode), GFP_KERNEL);
+	if (!pernode)
+		return -ENOMEM;
 	for(i = 0; i < scullc_devs; i++) {
 		d = &scullc_devices[i];
-		if (down_interruptible (&d->lock))
+		if (mutex_lock_interruptible (&d->lock)) {
+			kfree(pernode);
 			return -ERESTARTSYS;
+		}
 		qset = d->qset;  /* retrieve the features of each device */
 		quantum=d->quantum;
-		seq_printf(m,"\nDevice %i: qset %i, quantum %i, sz %li\n",
-				i, qset, quantum, (long)(d->size));
+		seq_printf(m,"\nDevice %i: qset %i, quantum %i, sz %li, numa %i\n",
+				i, qset, quantum, (long)(d->size), d->numa);
+		/* where the quanta are, node by node */
+		memset(pernode, 0, nr_node_ids * sizeof(*pernode));
+		for (; d; d = d->next)
+			for (j = 0; d->data && j < qset; j++)
+				if (d->data[j])
+					pernode[page_to_nid(virt_to_page(d->data[j]))]++;
+		for_each_node_state(nid, N_MEMORY)
+			seq_printf(m,"  node %i: %lu quanta\n", nid, pernode[nid]);
+		d = &scullc_devices[i];
 		for (; d; d = d->next) { /* scan the list */
 			seq_printf(m,"  item at %p, qset at %p\n",d,d->data);
 			if (m->count > limit)
@@ -92,10 +117,11 @@ int scullc_read_procmem(struct seq_file *m, void *v)
 				}
 		}
 	  out:
-		up (&scullc_devices[i].lock);
+		mutex_unlock (&scullc_devices[i].lock);
 		if (m->count > limit)
 			break;
 	}
+	kfree(pernode);
 	return 0;
 }
 
@@ -127,6 +153,7 @@ int scullc_open (struct inode *inode, struct file *filp)
 
     	/* now trim to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
+		scullc_drop_stage(dev);
 		if (mutex_lock_interruptible (&dev->lock))
 			return -ERESTARTSYS;
 		scullc_trim(dev); /* ignore errors */
@@ -141,6 +168,9 @@ int scullc_open (struct inode *inode, struct file *filp)
 
 int scullc_release (struct inode *inode, struct file *filp)
 {
+	/* what this file appended should not wait for the timer */
+	if (filp->f_flags & O_APPEND)
+		scullc_flush_stage(filp->private_data);
 	return 0;
 }
 
@@ -152,6 +182,8 @@ struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n)
 	while (n--) {
 		if (!dev->next) {
 			dev->next = kmalloc(sizeof(struct scullc_dev), GFP_KERNEL);
+			if (!dev->next)
+				return NULL;
 			memset(dev->next, 0, sizeof(struct scullc_dev));
 		}
 		dev = dev->next;
@@ -175,6 +207,10 @@ ssize_t scullc_read (struct file *filp, char __user *buf, size_t count,
 	int item, s_pos, q_pos, rest;
 	ssize_t retval = 0;
 
+	/* appends not yet stored must be seen; out of memory, say so */
+	retval = scullc_flush_stage(dev);
+	if (retval)
+		return retval;
 	if (mutex_lock_interruptible (&dev->lock))
 		return -ERESTARTSYS;
 	if (*f_pos > dev->size) 
@@ -189,7 +225,7 @@ ssize_t scullc_read (struct file *filp, char __user *buf, size_t count,
     	/* follow the list up to the right position (defined elsewhere) */
 	dptr = scullc_follow(dev, item);
 
-	if (!dptr->data)
+	if (!dptr || !dptr->data)
 		goto nothing; /* don't fill holes */
 	if (!dptr->data[s_pos])
 		goto nothing;
@@ -212,43 +248,67 @@ ssize_t scullc_read (struct file *filp, char __user *buf, size_t count,
 
 
 
+/*
+ * Return quantum "s_pos" of list item "item", allocating it (and the
+ * list item, and its quantum set) if missing. Called with the lock held.
+ */
+static void *scullc_quantum(struct scullc_dev *dev, int item, int s_pos)
+{
+	struct scullc_dev *dptr;
+	int qset = dev->qset;
+
+	dptr = scullc_follow(dev, item);
+	if (!dptr)
+		return NULL;
+	if (!dptr->data) {
+		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
+		if (!dptr->data)
+			return NULL;
+		memset(dptr->data, 0, qset * sizeof(char *));
+	}
+	/* Allocate a quantum using the memory cache, where the policy says */
+	if (!dptr->data[s_pos]) {
+		dptr->data[s_pos] = kmem_cache_alloc_node(scullc_cache, GFP_KERNEL,
+				scull_numa_node(dev->numa, &dev->numa_next));
+		if (!dptr->data[s_pos])
+			return NULL;
+		memset(dptr->data[s_pos], 0, scullc_quantum);
+	}
+	return dptr->data[s_pos];
+}
+
 ssize_t scullc_write (struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scullc_dev *dev = filp->private_data;
-	struct scullc_dev *dptr;
+	void *qptr;
 	int quantum = dev->quantum;
 	int qset = dev->qset;
 	int itemsize = quantum * qset;
 	int item, s_pos, q_pos, rest;
 	ssize_t retval = -ENOMEM; /* our most likely error */
 
+	if ((filp->f_flags & (O_APPEND | O_DSYNC)) == O_APPEND && dev->stage
+	    && count <= scullc_stage)
+		return scullc_stage_write(dev, buf, count);
+
 	if (mutex_lock_interruptible (&dev->lock))
 		return -ERESTARTSYS;
+	if (filp->f_flags & O_APPEND)
+		*f_pos = dev->size;
 
 	/* find listitem, qset index and offset in the quantum */
 	item = ((long) *f_pos) / itemsize;
 	rest = ((long) *f_pos) % itemsize;
 	s_pos = rest / quantum; q_pos = rest % quantum;
 
-	/* follow the list up to the right position */
-	dptr = scullc_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Allocate a quantum using the memory cache */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmem_cache_alloc(scullc_cache, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, scullc_quantum);
-	}
+	/* follow the list up to the right position, allocating */
+	qptr = scullc_quantum(dev, item, s_pos);
+	if (!qptr)
+		goto nomem;
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
+	if (copy_from_user (qptr+q_pos, buf, count)) {
 		retval = -EFAULT;
 		goto nomem;
 	}
@@ -265,6 +325,135 @@ ssize_t scullc_write (struct file *filp, const char __user *buf, size_t count,
 	return retval;
 }
 
+/*
+ * Staged appends. A writer takes the buffer of the CPU it runs on,
+ * with its mutex since copying from user space may sleep (and move
+ * us elsewhere: that's fine, the buffer is ours until we unlock), and
+ * only takes the device lock when the buffer has to be emptied.
+ */
+
+/*
+ * Store "count" bytes of "buf" at the end of the device. The size is
+ * only updated when all is there, so a failure leaves nothing behind
+ * and the bytes can be stored again later. Called with the lock held.
+ */
+static int scullc_store(struct scullc_dev *dev, const char *buf, size_t count)
+{
+	int quantum = dev->quantum;
+	int itemsize = quantum * dev->qset;
+	loff_t pos = dev->size;
+	int s_pos, q_pos, rest;
+	size_t chunk;
+	void *qptr;
+
+	while (count) {
+		rest = ((long) pos) % itemsize;
+		s_pos = rest / quantum; q_pos = rest % quantum;
+		qptr = scullc_quantum(dev, ((long) pos) / itemsize, s_pos);
+		if (!qptr)
+			return -ENOMEM;
+		chunk = min_t(size_t, count, quantum - q_pos);
+		memcpy(qptr + q_pos, buf, chunk);
+		buf += chunk;
+		pos += chunk;
+		count -= chunk;
+	}
+	dev->size = pos;
+	return 0;
+}
+
+/* Empty one CPU's buffer into the device; called with its mutex held */
+static int scullc_flush_one(struct scullc_dev *dev, struct scullc_stage *st)
+{
+	int retval;
+
+	if (!st->len)
+		return 0;
+	mutex_lock(&dev->lock);
+	retval = scullc_store(dev, st->buf, st->len);
+	mutex_unlock(&dev->lock);
+	if (!retval)
+		st->len = 0;
+	return retval;
+}
+
+int scullc_flush_stage(struct scullc_dev *dev)
+{
+	struct scullc_stage *st;
+	int cpu, err, retval = 0;
+
+	if (!dev->stage)
+		return 0;
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(dev->stage, cpu);
+		mutex_lock(&st->lock);
+		err = scullc_flush_one(dev, st);
+		mutex_unlock(&st->lock);
+		if (err)
+			retval = err;
+	}
+	return retval;
+}
+
+static void scullc_flush_work(struct work_struct *work)
+{
+	struct scullc_dev *dev = container_of(to_delayed_work(work),
+			struct scullc_dev, flush_work);
+
+	if (scullc_flush_stage(dev)) /* out of memory: try again later */
+		schedule_delayed_work(&dev->flush_work,
+				msecs_to_jiffies(scullc_stage_ms));
+}
+
+/* Forget what is staged: the device is being trimmed */
+static void scullc_drop_stage(struct scullc_dev *dev)
+{
+	struct scullc_stage *st;
+	int cpu;
+
+	if (!dev->stage)
+		return;
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(dev->stage, cpu);
+		mutex_lock(&st->lock);
+		st->len = 0;
+		mutex_unlock(&st->lock);
+	}
+}
+
+static ssize_t scullc_stage_write(struct scullc_dev *dev,
+		const char __user *buf, size_t count)
+{
+	struct scullc_stage *st = raw_cpu_ptr(dev->stage);
+	ssize_t retval;
+
+	if (mutex_lock_interruptible(&st->lock))
+		return -ERESTARTSYS;
+	if (st->len + count > scullc_stage) {
+		retval = scullc_flush_one(dev, st);
+		if (retval)
+			goto out;
+	}
+	if (copy_from_user(st->buf + st->len, buf, count)) {
+		retval = -EFAULT;
+		goto out;
+	}
+	if (!st->len) /* the first in here: make sure it gets out */
+		schedule_delayed_work(&dev->flush_work,
+				msecs_to_jiffies(scullc_stage_ms));
+	st->len += count;
+	retval = count;
+  out:
+	mutex_unlock(&st->lock);
+	return retval;
+}
+
+static int scullc_fsync(struct file *filp, loff_t start, loff_t end,
+		int datasync)
+{
+	return scullc_flush_stage(filp->private_data);
+}
+
 /*
  * The ioctl() implementation
  */
@@ -273,6 +462,7 @@ long scullc_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
 	int err = 0, ret = 0, tmp;
+	struct scullc_dev *dev = filp->private_data;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
 	if (_IOC_TYPE(cmd) != SCULLC_IOC_MAGIC) return -ENOTTY;
@@ -352,6 +542,23 @@ long scullc_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 		scullc_qset = arg;
 		return tmp;
 
+	/* The placement policy belongs to this device, and applies at once */
+	case SCULLC_IOCSNUMA:
+		ret = __get_user(tmp, (int __user *)arg);
+		if (ret)
+			break;
+		if (!scull_numa_valid(tmp))
+			return -EINVAL;
+		if (mutex_lock_interruptible (&dev->lock))
+			return -ERESTARTSYS;
+		dev->numa = tmp;
+		mutex_unlock (&dev->lock);
+		break;
+
+	case SCULLC_IOCGNUMA:
+		ret = __put_user(dev->numa, (int __user *)arg);
+		break;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -378,6 +585,8 @@ loff_t scullc_llseek (struct file *filp, loff_t off, int whence)
 		break;
 
 	case 2: /* SEEK_END */
+		if (scullc_flush_stage(dev))
+			return -ENOMEM;
 		newpos = dev->size + off;
 		break;
 
@@ -390,6 +599,25 @@ loff_t scullc_llseek (struct file *filp, loff_t off, int whence)
 }
 
 
+/*
+ * Asynchronous and vectored I/O: hand the request to this device's
+ * submission queue, which runs the read/write methods above
+ */
+ssize_t scullc_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scullc_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_read_iter(&dev->aq, iocb, to);
+}
+
+ssize_t scullc_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct scullc_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_write_iter(&dev->aq, iocb, from);
+}
+
+
 /*
  * The fops
  */
@@ -402,8 +630,9 @@ struct file_operations scullc_fops = {
 	.unlocked_ioctl = scullc_ioctl,
 	.open =	     scullc_open,
 	.release =   scullc_release,
-	.read_iter =  scull_read_iter,
-	.write_iter = scull_write_iter,
+	.fsync =     scullc_fsync,
+	.read_iter =  scullc_read_iter,
+	.write_iter = scullc_write_iter,
 };
 
 int scullc_trim(struct scullc_dev *dev)
@@ -435,6 +664,47 @@ int scullc_trim(struct scullc_dev *dev)
 }
 
 
+/*
+ * The staging buffers, one per possible CPU, each on its CPU's node.
+ * If they can't be had, the device appends directly.
+ */
+static void scullc_free_stage(struct scullc_dev *dev)
+{
+	int cpu;
+
+	if (!dev->stage)
+		return;
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(dev->stage, cpu)->buf);
+	free_percpu(dev->stage);
+	dev->stage = NULL;
+}
+
+static void scullc_setup_stage(struct scullc_dev *dev)
+{
+	struct scullc_stage *st;
+	int cpu;
+
+	INIT_DELAYED_WORK(&dev->flush_work, scullc_flush_work);
+	if (scullc_stage <= 0)
+		return;
+	dev->stage = alloc_percpu(struct scullc_stage);
+	if (!dev->stage)
+		goto fail;
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(dev->stage, cpu);
+		mutex_init(&st->lock);
+		st->buf = kmalloc_node(scullc_stage, GFP_KERNEL, cpu_to_node(cpu));
+		if (!st->buf)
+			goto fail;
+	}
+	return;
+
+  fail:
+	scullc_free_stage(dev);
+	printk(KERN_WARNING "scullc: no staging buffers, appending directly\n");
+}
+
 static void scullc_setup_cdev(struct scullc_dev *dev, int index)
 {
 	int err, devno = MKDEV(scullc_major, index);
@@ -471,6 +741,12 @@ int scullc_init(void)
 	if (result < 0)
 		return result;
 
+	result = scull_async_init("scullc");
+	if (result < 0) {
+		unregister_chrdev_region(dev, scullc_devs);
+		return result;
+	}
+
 	
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
@@ -482,10 +758,19 @@ int scullc_init(void)
 		goto fail_malloc;
 	}
 	memset(scullc_devices, 0, scullc_devs*sizeof (struct scullc_dev));
+	if (!scull_numa_valid(scullc_numa)) {
+		printk(KERN_WARNING "scullc: bad NUMA policy %i, using local\n",
+				scullc_numa);
+		scullc_numa = SCULL_NUMA_LOCAL;
+	}
 	for (i = 0; i < scullc_devs; i++) {
 		scullc_devices[i].quantum = scullc_quantum;
 		scullc_devices[i].qset = scullc_qset;
+		scullc_devices[i].numa = scullc_numa;
+		scullc_devices[i].numa_next = NUMA_NO_NODE;
 		mutex_init (&scullc_devices[i].lock);
+		scull_async_init_queue(&scullc_devices[i].aq);
+		scullc_setup_stage(scullc_devices + i);
 		scullc_setup_cdev(scullc_devices + i, i);
 	}
 
@@ -502,6 +787,7 @@ int scullc_init(void)
 	return 0; /* succeed */
 
   fail_malloc:
+	scull_async_cleanup();
 	unregister_chrdev_region(dev, scullc_devs);
 	return result;
 }
@@ -518,12 +804,16 @@ void scullc_cleanup(void)
 
 	for (i = 0; i < scullc_devs; i++) {
 		cdev_del(&scullc_devices[i].cdev);
+		scull_async_flush_queue(&scullc_devices[i].aq);
+		cancel_delayed_work_sync(&scullc_devices[i].flush_work);
+		scullc_free_stage(scullc_devices + i);
 		scullc_trim(scullc_devices + i);
 	}
 	kfree(scullc_devices);
 
 	if (scullc_cache)
 		kmem_cache_destroy(scullc_cache);
+	scull_async_cleanup();
 	unregister_chrdev_region(MKDEV (scullc_major, 0), scullc_devs);
 }
 
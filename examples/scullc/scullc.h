@@ -15,6 +15,10 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include "scull-shared/scull-async.h"
+#include "scull-shared/scull-numa.h"
 
 /*
  * Macros to help debugging
@@ -52,6 +56,24 @@
 #define SCULLC_QUANTUM  4000 /* use a quantum size like scull */
 #define SCULLC_QSET     500
 
+/*
+ * Staged appends, off unless loaded with scullc_stage set (16384 is a
+ * good size). Appends (O_APPEND, without O_DSYNC) that fit are then
+ * collected in a buffer per CPU, and moved to the device under the
+ * lock in one go: when the buffer is full, after SCULLC_STAGE_MS, on
+ * fsync or close, and before a read or a seek from the end, so that
+ * what was written can be read back. Records stay whole, but only
+ * those from one CPU keep their order: that is why it must be asked.
+ */
+#define SCULLC_STAGE    0     /* bytes per CPU, 0 to append directly */
+#define SCULLC_STAGE_MS 100
+
+struct scullc_stage {
+	struct mutex lock;        /* the writers on this CPU, and flushes */
+	int len;                  /* bytes waiting in buf */
+	char *buf;
+};
+
 struct scullc_dev {
 	void **data;
 	struct scullc_dev *next;  /* next listitem */
@@ -59,8 +81,13 @@ struct scullc_dev {
 	int quantum;              /* the current allocation size */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	int numa;                 /* placement policy, see scull-numa.h */
+	int numa_next;            /* the last node, when interleaving */
+	struct scullc_stage __percpu *stage; /* appends not yet stored */
+	struct delayed_work flush_work;  /* stores them after a while */
 	struct mutex lock;     /* Mutual exclusion */
 	struct cdev cdev;
+	struct scull_async_queue aq; /* asynchronous requests */
 };
 
 extern struct scullc_dev *scullc_devices;
@@ -74,12 +101,16 @@ extern int scullc_major;     /* main.c */
 extern int scullc_devs;
 extern int scullc_order;
 extern int scullc_qset;
+extern int scullc_numa;
+extern int scullc_stage;
+extern int scullc_stage_ms;
 
 /*
  * Prototypes for shared functions
  */
 int scullc_trim(struct scullc_dev *dev);
 struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n);
+int scullc_flush_stage(struct scullc_dev *dev);
 
 
 #ifdef SCULLC_DEBUG
@@ -116,7 +147,11 @@ struct scullc_dev *scullc_follow(struct scullc_dev *dev, int n);
 #define SCULLC_IOCXQSET    _IOWR(SCULLC_IOC_MAGIC,11, int)
 #define SCULLC_IOCHQSET    _IO(SCULLC_IOC_MAGIC,  12)
 
-#define SCULLC_IOC_MAXNR 12
+/* The placement of this device's quanta, SCULL_NUMA_* or a node */
+#define SCULLC_IOCSNUMA    _IOW(SCULLC_IOC_MAGIC, 13, int)
+#define SCULLC_IOCGNUMA    _IOR(SCULLC_IOC_MAGIC, 14, int)
+
+#define SCULLC_IOC_MAXNR 14
 
 
 
@@ -401,6 +401,25 @@ loff_t sculld_llseek (struct file *filp, loff_t off, int whence)
 extern int sculld_mmap(struct file *filp, struct vm_area_struct *vma);
 
 
+/*
+ * Asynchronous and vectored I/O: hand the request to this device's
+ * submission queue, which runs the read/write methods above
+ */
+ssize_t sculld_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct sculld_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_read_iter(&dev->aq, iocb, to);
+}
+
+ssize_t sculld_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct sculld_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_write_iter(&dev->aq, iocb, from);
+}
+
+
 /*
  * The fops
  */
@@ -414,8 +433,8 @@ struct file_operations sculld_fops = {
 	.mmap =	     sculld_mmap,
 	.open =	     sculld_open,
 	.release =   sculld_release,
-	.read_iter =  scull_read_iter,
-	.write_iter = scull_write_iter,
+	.read_iter =  sculld_read_iter,
+	.write_iter = sculld_write_iter,
 };
 
 int sculld_trim(struct sculld_dev *dev)
@@ -503,6 +522,12 @@ int sculld_init(void)
 	if (result < 0)
 		return result;
 
+	result = scull_async_init("sculld");
+	if (result < 0) {
+		unregister_chrdev_region(dev, sculld_devs);
+		return result;
+	}
+
 	/*
 	 * Register with the driver core.
 	 */
@@ -522,6 +547,7 @@ int sculld_init(void)
 		sculld_devices[i].order = sculld_order;
 		sculld_devices[i].qset = sculld_qset;
 		mutex_init(&sculld_devices[i].mutex);
+		scull_async_init_queue(&sculld_devices[i].aq);
 		sculld_setup_cdev(sculld_devices + i, i);
 		sculld_register_dev(sculld_devices + i, i);
 	}
@@ -533,6 +559,7 @@ int sculld_init(void)
 	return 0; /* succeed */
 
   fail_malloc:
+	scull_async_cleanup();
 	unregister_chrdev_region(dev, sculld_devs);
 	return result;
 }
@@ -550,10 +577,12 @@ void sculld_cleanup(void)
 	for (i = 0; i < sculld_devs; i++) {
 		unregister_ldd_device(&sculld_devices[i].ldev);
 		cdev_del(&sculld_devices[i].cdev);
+		scull_async_flush_queue(&sculld_devices[i].aq);
 		sculld_trim(sculld_devices + i);
 	}
 	kfree(sculld_devices);
 	unregister_ldd_driver(&sculld_driver);
+	scull_async_cleanup();
 	unregister_chrdev_region(MKDEV (sculld_major, 0), sculld_devs);
 }
 
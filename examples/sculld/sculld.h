@@ -15,6 +15,7 @@
 
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
+#include "scull-shared/scull-async.h"
 #include <linux/device.h>
 #include "../include/lddbus.h"
 
@@ -63,6 +64,7 @@ struct sculld_dev {
 	size_t size;              /* 32-bit will suffice */
 	struct mutex mutex;     /* Mutual exclusion */
 	struct cdev cdev;
+	struct scull_async_queue aq; /* asynchronous requests */
 	char devname[20];
 	struct ldd_device ldev;
 };
@@ -37,11 +37,13 @@ int scullp_major =   SCULLP_MAJOR;
 int scullp_devs =    SCULLP_DEVS;	/* number of bare scullp devices */
 int scullp_qset =    SCULLP_QSET;
 int scullp_order =   SCULLP_ORDER;
+int scullp_numa =    SCULL_NUMA_LOCAL; /* for all devices, at load time */
 
 module_param(scullp_major, int, 0);
 module_param(scullp_devs, int, 0);
 module_param(scullp_qset, int, 0);
 module_param(scullp_order, int, 0);
+module_param(scullp_numa, int, 0);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -63,18 +65,33 @@ void scullp_cleanup(void);
 /* FIXME: Do we need this here??  It be ugly  */
 int scullp_read_procmem(struct seq_file *m, void *v)
 {
-	int i, j, order, qset;
+	int i, j, order, qset, nid;
 	int limit = m->size - 80; /* Don't print more than this */
 	struct scullp_dev *d;
+	unsigned long *pernode;
 
+	pernode = kcalloc(nr_node_ids, sizeof(*pernode), GFP_KERNEL);
+	if (!pernode)
+		return -ENOMEM;
 	for(i = 0; i < scullp_devs; i++) {
 		d = &scullp_devices[i];
-		if (down_interruptible (&d->mutex))
+		if (mutex_lock_interruptible(&d->mutex)) {
+			kfree(pernode);
 			return -ERESTARTSYS;
+		}
 		qset = d->qset;  /* retrieve the features of each device */
 		order = d->order;
-		seq_printf(m,"\nDevice %i: qset %i, order %i, sz %li\n",
-				i, qset, order, (long)(d->size));
+		seq_printf(m,"\nDevice %i: qset %i, order %i, sz %li, numa %i\n",
+				i, qset, order, (long)(d->size), d->numa);
+		/* where the quanta are, node by node */
+		memset(pernode, 0, nr_node_ids * sizeof(*pernode));
+		for (; d; d = d->next)
+			for (j = 0; d->data && j < qset; j++)
+				if (d->data[j])
+					pernode[page_to_nid(virt_to_page(d->data[j]))]++;
+		for_each_node_state(nid, N_MEMORY)
+			seq_printf(m,"  node %i: %lu quanta\n", nid, pernode[nid]);
+		d = &scullp_devices[i];
 		for (; d; d = d->next) { /* scan the list */
 			seq_printf(m,"  item at %p, qset at %p\n",d,d->data);
 			if (m->count > limit)
@@ -88,10 +105,11 @@ int scullp_read_procmem(struct seq_file *m, void *v)
 				}
 		}
 	  out:
-		up (&scullp_devices[i].mutex);
+		mutex_unlock(&scullp_devices[i].mutex);
 		if (m->count > limit)
 			break;
 	}
+	kfree(pernode);
 	return 0;
 }
 
@@ -141,19 +159,53 @@ int scullp_release (struct inode *inode, struct file *filp)
 }
 
 /*
- * Follow the list 
+ * Follow the list. The first item keeps an index of all of them, so
+ * that the mmap fault paths, which come here for every page, don't
+ * walk further and further down the list as the offset grows. Items
+ * are only appended until the next trim, so the index stays valid; if
+ * it can't be grown, the list is walked from the last indexed item.
  */
 struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n)
 {
-	while (n--) {
-		if (!dev->next) {
-			dev->next = kmalloc(sizeof(struct scullp_dev), GFP_KERNEL);
-			memset(dev->next, 0, sizeof(struct scullp_dev));
+	struct scullp_dev *ptr, **items;
+	int i, max;
+
+	if (n < 0)
+		return NULL;
+	if (n < dev->nitems)
+		return dev->items[n];
+
+	if (n >= dev->maxitems) {
+		max = max(n + 1, 2 * dev->maxitems);
+		items = kvmalloc_array(max, sizeof(*items), GFP_KERNEL);
+		if (items) {
+			if (dev->nitems)
+				memcpy(items, dev->items,
+						dev->nitems * sizeof(*items));
+			kvfree(dev->items);
+			dev->items = items;
+			dev->maxitems = max;
+		}
+	}
+
+	i = dev->nitems ? dev->nitems - 1 : 0;
+	ptr = dev->nitems ? dev->items[i] : dev;
+	for (;;) {
+		if (i >= dev->nitems && i < dev->maxitems) {
+			dev->items[i] = ptr;
+			dev->nitems = i + 1;
+		}
+		if (i == n)
+			return ptr;
+		if (!ptr->next) {
+			ptr->next = kmalloc(sizeof(struct scullp_dev), GFP_KERNEL);
+			if (!ptr->next)
+				return NULL;
+			memset(ptr->next, 0, sizeof(struct scullp_dev));
 		}
-		dev = dev->next;
-		continue;
+		ptr = ptr->next;
+		i++;
 	}
-	return dev;
 }
 
 /*
@@ -185,7 +237,7 @@ ssize_t scullp_read (struct file *filp, char __user *buf, size_t count,
     	/* follow the list up to the right position (defined elsewhere) */
 	dptr = scullp_follow(dev, item);
 
-	if (!dptr->data)
+	if (!dptr || !dptr->data)
 		goto nothing; /* don't fill holes */
 	if (!dptr->data[s_pos])
 		goto nothing;
@@ -219,6 +271,9 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
 	int item, s_pos, q_pos, rest;
 	ssize_t retval = -ENOMEM; /* our most likely error */
 
+	/* items are numbered with an int: there is no storing past that */
+	if (*f_pos < 0 || *f_pos >= (loff_t)INT_MAX * itemsize)
+		return -EFBIG;
 	if (mutex_lock_interruptible(&dev->mutex))
 		return -ERESTARTSYS;
 
@@ -229,6 +284,8 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
 
 	/* follow the list up to the right position */
 	dptr = scullp_follow(dev, item);
+	if (!dptr)
+		goto nomem;
 	if (!dptr->data) {
 		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
 		if (!dptr->data)
@@ -237,11 +294,10 @@ ssize_t scullp_write (struct file *filp, const char __user *buf, size_t count,
 	}
 	/* Here's the allocation of a single quantum */
 	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] =
-			(void *)__get_free_pages(GFP_KERNEL, dptr->order);
+		dptr->data[s_pos] = scullp_alloc_quantum(dev->order,
+				scull_numa_node(dev->numa, &dev->numa_next));
 		if (!dptr->data[s_pos])
 			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
 	}
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
@@ -270,6 +326,7 @@ long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
 	int err = 0, ret = 0, tmp;
+	struct scullp_dev *dev = filp->private_data;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
 	if (_IOC_TYPE(cmd) != SCULLP_IOC_MAGIC) return -ENOTTY;
@@ -349,6 +406,23 @@ long scullp_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 		scullp_qset = arg;
 		return tmp;
 
+	/* The placement policy belongs to this device, and applies at once */
+	case SCULLP_IOCSNUMA:
+		ret = __get_user(tmp, (int __user *)arg);
+		if (ret)
+			break;
+		if (!scull_numa_valid(tmp))
+			return -EINVAL;
+		if (mutex_lock_interruptible(&dev->mutex))
+			return -ERESTARTSYS;
+		dev->numa = tmp;
+		mutex_unlock(&dev->mutex);
+		break;
+
+	case SCULLP_IOCGNUMA:
+		ret = __put_user(dev->numa, (int __user *)arg);
+		break;
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -391,6 +465,27 @@ loff_t scullp_llseek (struct file *filp, loff_t off, int whence)
  * Mmap *is* available, but confined in a different file
  */
 extern int scullp_mmap(struct file *filp, struct vm_area_struct *vma);
+extern int scullp_fadvise(struct file *filp, loff_t offset, loff_t len,
+		int advice);
+
+
+/*
+ * Asynchronous and vectored I/O: hand the request to this device's
+ * submission queue, which runs the read/write methods above
+ */
+ssize_t scullp_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scullp_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_read_iter(&dev->aq, iocb, to);
+}
+
+ssize_t scullp_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct scullp_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_write_iter(&dev->aq, iocb, from);
+}
 
 
 /*
@@ -404,12 +499,45 @@ struct file_operations scullp_fops = {
 	.write =     scullp_write,
 	.unlocked_ioctl = scullp_ioctl,
 	.mmap =	     scullp_mmap,
+	.fadvise =   scullp_fadvise,
 	.open =	     scullp_open,
 	.release =   scullp_release,
-	.read_iter =  scull_read_iter,
-	.write_iter = scull_write_iter,
+	.read_iter =  scullp_read_iter,
+	.write_iter = scullp_write_iter,
 };
 
+/*
+ * Allocate and free a quantum, zeroed; scullp.h tells why the pages
+ * are split. The node comes from
+ * scull_numa_node: NUMA_NO_NODE leaves it to the task's memory policy.
+ */
+void *scullp_alloc_quantum(int order, int nid)
+{
+	gfp_t flags = GFP_KERNEL | __GFP_ZERO;
+	struct page *page;
+
+	if (nid == NUMA_NO_NODE)
+		page = alloc_pages(flags, order);
+	else
+		page = alloc_pages_node(nid, flags, order);
+	if (page && order)
+		split_page(page, order);
+	return page ? page_address(page) : NULL;
+}
+
+void scullp_free_quantum(void *quantum, int order)
+{
+	struct page *page = virt_to_page(quantum);
+	int i;
+
+	if (!order) {
+		__free_page(page);
+		return;
+	}
+	for (i = 0; i < (1 << order); i++) /* split: one by one */
+		__free_page(page + i);
+}
+
 int scullp_trim(struct scullp_dev *dev)
 {
 	struct scullp_dev *next, *dptr;
@@ -424,8 +552,8 @@ int scullp_trim(struct scullp_dev *dev)
 			/* This code frees a whole quantum-set */
 			for (i = 0; i < qset; i++)
 				if (dptr->data[i])
-					free_pages((unsigned long)(dptr->data[i]),
-							dptr->order);
+					scullp_free_quantum(dptr->data[i],
+							dev->order);
 
 			kfree(dptr->data);
 			dptr->data=NULL;
@@ -433,6 +561,9 @@ int scullp_trim(struct scullp_dev *dev)
 		next=dptr->next;
 		if (dptr != dev) kfree(dptr); /* all of them but the first */
 	}
+	kvfree(dev->items);
+	dev->items = NULL;
+	dev->nitems = dev->maxitems = 0;
 	dev->size = 0;
 	dev->qset = scullp_qset;
 	dev->order = scullp_order;
@@ -477,6 +608,12 @@ int scullp_init(void)
 	if (result < 0)
 		return result;
 
+	result = scull_async_init("scullp");
+	if (result < 0) {
+		unregister_chrdev_region(dev, scullp_devs);
+		return result;
+	}
+
 	
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
@@ -488,10 +625,18 @@ int scullp_init(void)
 		goto fail_malloc;
 	}
 	memset(scullp_devices, 0, scullp_devs*sizeof (struct scullp_dev));
+	if (!scull_numa_valid(scullp_numa)) {
+		printk(KERN_WARNING "scullp: bad NUMA policy %i, using local\n",
+				scullp_numa);
+		scullp_numa = SCULL_NUMA_LOCAL;
+	}
 	for (i = 0; i < scullp_devs; i++) {
 		scullp_devices[i].order = scullp_order;
 		scullp_devices[i].qset = scullp_qset;
+		scullp_devices[i].numa = scullp_numa;
+		scullp_devices[i].numa_next = NUMA_NO_NODE;
 		mutex_init(&scullp_devices[i].mutex);
+		scull_async_init_queue(&scullp_devices[i].aq);
 		scullp_setup_cdev(scullp_devices + i, i);
 	}
 
@@ -502,6 +647,7 @@ int scullp_init(void)
 	return 0; /* succeed */
 
   fail_malloc:
+	scull_async_cleanup();
 	unregister_chrdev_region(dev, scullp_devs);
 	return result;
 }
@@ -518,9 +664,11 @@ void scullp_cleanup(void)
 
 	for (i = 0; i < scullp_devs; i++) {
 		cdev_del(&scullp_devices[i].cdev);
+		scull_async_flush_queue(&scullp_devices[i].aq);
 		scullp_trim(scullp_devices + i);
 	}
 	kfree(scullp_devices);
+	scull_async_cleanup();
 	unregister_chrdev_region(MKDEV (scullp_major, 0), scullp_devs);
 }
 
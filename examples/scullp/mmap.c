@@ -21,6 +21,8 @@
 #include <linux/errno.h>	/* error codes */
 #include <asm/pgtable.h>
 #include <linux/fs.h>
+#include <linux/sched.h>	/* current */
+#include <linux/fadvise.h>	/* POSIX_FADV_WILLNEED */
 
 #include "scullp.h"		/* local definitions */
 
@@ -44,58 +46,115 @@ void scullp_vma_close(struct vm_area_struct *vma)
 	dev->vmas--;
 }
 
+/*
+ * Find the page at "pgoff" in the device, or NULL for holes and past
+ * the end. With an order above zero, the quantum holding the page is
+ * found first and then the page within it. That works because no
+ * quantum is a plain multipage block, where only the first page is
+ * counted: they are split in single pages (see scullp.h).
+ * The list items are indexed (see scullp_follow), so the cost doesn't
+ * depend on the offset. Called with the device mutex held.
+ */
+static struct page *scullp_find_page(struct scullp_dev *dev, pgoff_t pgoff)
+{
+	struct scullp_dev *ptr;
+	unsigned long quantum;
+	void *pageptr;
+
+	if (pgoff >= (dev->size + PAGE_SIZE - 1) >> PAGE_SHIFT)
+		return NULL; /* out of range */
+	quantum = pgoff >> dev->order;
+	ptr = scullp_follow(dev, quantum / dev->qset);
+	if (!ptr || !ptr->data)
+		return NULL;
+	pageptr = ptr->data[quantum % dev->qset];
+	if (!pageptr)
+		return NULL;
+	return virt_to_page(pageptr) + (pgoff & ((1 << dev->order) - 1));
+}
+
+/*
+ * Map the pages we have between "start" and "end" (inclusive, in file
+ * pages) into the area, leaving out "skip", holes and anything already
+ * mapped. vm_insert_page counts each page as nopage does, and works
+ * on an area that is in use because it is VM_MIXEDMAP (see below).
+ * Called with the device mutex held.
+ */
+static void scullp_map_range(struct vm_area_struct *vma, pgoff_t start,
+		pgoff_t end, pgoff_t skip)
+{
+	struct scullp_dev *dev = vma->vm_private_data;
+	struct page *page;
+	pgoff_t pgoff;
+
+	for (pgoff = start; pgoff <= end; pgoff++) {
+		if (pgoff == skip)
+			continue;
+		page = scullp_find_page(dev, pgoff);
+		if (!page) {
+			if (pgoff << PAGE_SHIFT >= dev->size)
+				break; /* nothing more after the end */
+			continue;
+		}
+		vm_insert_page(vma, vma->vm_start +
+				((pgoff - vma->vm_pgoff) << PAGE_SHIFT), page);
+	}
+}
+
+/*
+ * Fault-around, done by hand: a read fault maps the pages we have in
+ * the SCULLP_AROUND-page block around the faulting one too, so that a
+ * walk through the area takes one fault every few pages rather than
+ * one per page. The core's map_pages method would do the same, but it
+ * may be called with the page table locked, where we can't take the
+ * device mutex; here we hold nothing but the mmap semaphore.
+ * Called with the device mutex held.
+ */
+#define SCULLP_AROUND 16	/* pages, 64kB like the core's default */
+
+static void scullp_fault_around(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	pgoff_t start, end;
+
+	start = max(vmf->pgoff & ~(pgoff_t)(SCULLP_AROUND - 1), vma->vm_pgoff);
+	end = min(vmf->pgoff | (SCULLP_AROUND - 1),
+			vma->vm_pgoff + vma_pages(vma) - 1);
+	scullp_map_range(vma, start, end, vmf->pgoff);
+}
+
 /*
  * The nopage method: the core of the file. It retrieves the
  * page required from the scullp device and returns it to the
  * user. The count for the page must be incremented, because
  * it is automatically decremented at page unmap.
- *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
  */
 
 static int scullp_vma_nopage(struct vm_fault *vmf)
 {
-	unsigned long offset;
 	struct vm_area_struct *vma = vmf->vma;
-	struct scullp_dev *ptr, *dev = vma->vm_private_data;
-	struct page *page = NULL;
-	void *pageptr = NULL; /* default to "missing" */
-	int retval = VM_FAULT_NOPAGE;
-
-	mutex_lock(&dev->mutex);
-	offset = (unsigned long)(vmf->address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
-	if (offset >= dev->size) goto out; /* out of range */
+	struct scullp_dev *dev = vma->vm_private_data;
+	struct page *page;
+	int retval = VM_FAULT_SIGBUS;
 
 	/*
-	 * Now retrieve the scullp device from the list,then the page.
 	 * If the device has holes, the process receives a SIGBUS when
 	 * accessing the hole.
 	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
-		ptr = ptr->next;
-		offset -= dev->qset;
+	mutex_lock(&dev->mutex);
+	page = scullp_find_page(dev, vmf->pgoff);
+	if (page) {
+		/* got it, now increment the count */
+		get_page(page);
+		vmf->page = page;
+		retval = 0;
+		if (!(vmf->flags & FAULT_FLAG_WRITE))
+			scullp_fault_around(vmf);
 	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
-	page = virt_to_page(pageptr);
-
-	/* got it, now increment the count */
-	get_page(page);
-	vmf->page = page;
-	retval = 0;
-
-  out:
 	mutex_unlock(&dev->mutex);
 	return retval;
 }
 
-
-
 struct vm_operations_struct scullp_vm_ops = {
 	.open =     scullp_vma_open,
 	.close =    scullp_vma_close,
@@ -105,16 +164,55 @@ struct vm_operations_struct scullp_vm_ops = {
 
 int scullp_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	struct inode *inode = filp->f_path.dentry->d_inode;
-
-	/* refuse to map if order is not 0 */
-	if (scullp_devices[iminor(inode)].order)
-		return -ENODEV;
+	struct scullp_dev *dev = filp->private_data;
 
-	/* don't do anything here: "nopage" will set up page table entries */
+	/*
+	 * Don't do anything here: "nopage" will set up page table
+	 * entries. VM_MIXEDMAP lets us map more at a time.
+	 */
+	vma->vm_flags |= VM_MIXEDMAP;
 	vma->vm_ops = &scullp_vm_ops;
-	vma->vm_private_data = filp->private_data;
+	vma->vm_private_data = dev;
 	scullp_vma_open(vma);
 	return 0;
 }
 
+/*
+ * madvise(MADV_WILLNEED) on the mapping ends up here, through
+ * vfs_fadvise, with the mmap semaphore released: map what we have in
+ * the range into all the caller's mappings of the device, so that the
+ * accesses that follow don't fault at all. MAP_POPULATE needs no help:
+ * it faults every page in, and fault-around maps the neighbours.
+ */
+int scullp_fadvise(struct file *filp, loff_t offset, loff_t len, int advice)
+{
+	struct scullp_dev *dev = filp->private_data;
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	pgoff_t start, end, last;
+
+	if (advice != POSIX_FADV_WILLNEED || !mm)
+		return generic_fadvise(filp, offset, len, advice);
+	if (offset < 0 || len < 0)
+		return -EINVAL;
+	start = offset >> PAGE_SHIFT;
+	if (!len || offset + len < offset)
+		end = ULONG_MAX; /* to the end of the file */
+	else
+		end = (offset + len - 1) >> PAGE_SHIFT;
+
+	down_read(&mm->mmap_sem);
+	mutex_lock(&dev->mutex);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (vma->vm_ops != &scullp_vm_ops || vma->vm_private_data != dev)
+			continue;
+		last = vma->vm_pgoff + vma_pages(vma) - 1;
+		if (start > last || end < vma->vm_pgoff)
+			continue;
+		scullp_map_range(vma, max(start, vma->vm_pgoff),
+				min(end, last), ULONG_MAX);
+	}
+	mutex_unlock(&dev->mutex);
+	up_read(&mm->mmap_sem);
+	return 0;
+}
@@ -0,0 +1 @@
+../../scull-shared/scull-numa.h
\ No newline at end of file
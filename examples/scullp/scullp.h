@@ -14,8 +14,13 @@
  */
 
 #include <linux/ioctl.h>
+#ifdef __KERNEL__
 #include <linux/cdev.h>
+#include <linux/mm.h>
+#include "scull-shared/scull-async.h"
 #include <linux/semaphore.h>
+#endif
+#include "scull-shared/scull-numa.h"
 
 /*
  * Macros to help debugging
@@ -53,15 +58,32 @@
 #define SCULLP_ORDER    0 /* one page at a time */
 #define SCULLP_QSET     500
 
+/*
+ * Quanta of any order are split into single pages, each with its own
+ * count, so that they can be mapped one by one; a large order makes
+ * fewer, bigger allocations, but not bigger mappings. There is no
+ * huge-page mode: neither way to install a PMD entry fits our memory
+ * on the kernels this tree targets. do_set_pmd() is for compound
+ * pages in the page cache, and zap_huge_pmd() takes what
+ * vmf_insert_pfn_pmd() installs outside DAX for a refcounted THP.
+ */
+
+#ifdef __KERNEL__ /* the rest is for the driver; the ioctls are for all */
+
 struct scullp_dev {
 	void **data;
 	struct scullp_dev *next;  /* next listitem */
+	struct scullp_dev **items;   /* all the listitems, in the first one */
+	int nitems, maxitems;     /* how many are in there, and room for */
 	int vmas;                 /* active mappings */
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
+	int numa;                 /* placement policy, see scull-numa.h */
+	int numa_next;            /* the last node, when interleaving */
 	struct mutex mutex;     /* Mutual exclusion */
 	struct cdev cdev;
+	struct scull_async_queue aq; /* asynchronous requests */
 };
 
 extern struct scullp_dev *scullp_devices;
@@ -75,13 +97,18 @@ extern int scullp_major;     /* main.c */
 extern int scullp_devs;
 extern int scullp_order;
 extern int scullp_qset;
+extern int scullp_numa;
 
 /*
  * Prototypes for shared functions
  */
 int scullp_trim(struct scullp_dev *dev);
+void *scullp_alloc_quantum(int order, int nid);
+void scullp_free_quantum(void *quantum, int order);
 struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n);
 
+#endif /* __KERNEL__ */
+
 
 #ifdef SCULLP_DEBUG
 #  define SCULLP_USE_PROC
@@ -117,7 +144,11 @@ struct scullp_dev *scullp_follow(struct scullp_dev *dev, int n);
 #define SCULLP_IOCXQSET    _IOWR(SCULLP_IOC_MAGIC,11, int)
 #define SCULLP_IOCHQSET    _IO(SCULLP_IOC_MAGIC,  12)
 
-#define SCULLP_IOC_MAXNR 12
+/* The placement of this device's quanta, SCULL_NUMA_* or a node */
+#define SCULLP_IOCSNUMA    _IOW(SCULLP_IOC_MAGIC, 13, int)
+#define SCULLP_IOCGNUMA    _IOR(SCULLP_IOC_MAGIC, 14, int)
+
+#define SCULLP_IOC_MAXNR 14
 
 
 
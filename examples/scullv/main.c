@@ -29,6 +29,7 @@
 #include <linux/aio.h>
 #include <linux/uaccess.h>
 #include <linux/vmalloc.h>
+#include <linux/mm.h>		/* kvmalloc() */
 #include "scull-shared/scull-async.h"
 #include "scullv.h"		/* local definitions */
 
@@ -37,11 +38,13 @@ int scullv_major =   SCULLV_MAJOR;
 int scullv_devs =    SCULLV_DEVS;	/* number of bare scullv devices */
 int scullv_qset =    SCULLV_QSET;
 int scullv_order =   SCULLV_ORDER;
+long scullv_map_max = SCULLV_MAP_MAX;
 
 module_param(scullv_major, int, 0);
 module_param(scullv_devs, int, 0);
 module_param(scullv_qset, int, 0);
 module_param(scullv_order, int, 0);
+module_param(scullv_map_max, long, S_IRUGO | S_IWUSR);
 MODULE_AUTHOR("Alessandro Rubini");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -141,19 +144,53 @@ int scullv_release (struct inode *inode, struct file *filp)
 }
 
 /*
- * Follow the list 
+ * Follow the list. The first item keeps an index of all of them, so
+ * that the mmap fault paths, which come here for every page, don't
+ * walk further and further down the list as the offset grows. Items
+ * are only appended until the next trim, so the index stays valid; if
+ * it can't be grown, the list is walked from the last indexed item.
  */
 struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n)
 {
-	while (n--) {
-		if (!dev->next) {
-			dev->next = kmalloc(sizeof(struct scullv_dev), GFP_KERNEL);
-			memset(dev->next, 0, sizeof(struct scullv_dev));
+	struct scullv_dev *ptr, **items;
+	int i, max;
+
+	if (n < 0)
+		return NULL;
+	if (n < dev->nitems)
+		return dev->items[n];
+
+	if (n >= dev->maxitems) {
+		max = max(n + 1, 2 * dev->maxitems);
+		items = kvmalloc_array(max, sizeof(*items), GFP_KERNEL);
+		if (items) {
+			if (dev->nitems)
+				memcpy(items, dev->items,
+						dev->nitems * sizeof(*items));
+			kvfree(dev->items);
+			dev->items = items;
+			dev->maxitems = max;
 		}
-		dev = dev->next;
-		continue;
 	}
-	return dev;
+
+	i = dev->nitems ? dev->nitems - 1 : 0;
+	ptr = dev->nitems ? dev->items[i] : dev;
+	for (;;) {
+		if (i >= dev->nitems && i < dev->maxitems) {
+			dev->items[i] = ptr;
+			dev->nitems = i + 1;
+		}
+		if (i == n)
+			return ptr;
+		if (!ptr->next) {
+			ptr->next = kmalloc(sizeof(struct scullv_dev), GFP_KERNEL);
+			if (!ptr->next)
+				return NULL;
+			memset(ptr->next, 0, sizeof(struct scullv_dev));
+		}
+		ptr = ptr->next;
+		i++;
+	}
 }
 
 /*
@@ -185,7 +222,7 @@ ssize_t scullv_read (struct file *filp, char __user *buf, size_t count,
     	/* follow the list up to the right position (defined elsewhere) */
 	dptr = scullv_follow(dev, item);
 
-	if (!dptr->data)
+	if (!dptr || !dptr->data)
 		goto nothing; /* don't fill holes */
 	if (!dptr->data[s_pos])
 		goto nothing;
@@ -208,17 +245,49 @@ ssize_t scullv_read (struct file *filp, char __user *buf, size_t count,
 
 
 
+/*
+ * Return quantum "s_pos" of list item "item", allocating it (and the
+ * list item, and its quantum set) if missing. Used by write and by
+ * write faults on shared mappings; called with the mutex held.
+ */
+void *scullv_quantum(struct scullv_dev *dev, int item, int s_pos)
+{
+	struct scullv_dev *dptr;
+	int qset = dev->qset;
+
+	dptr = scullv_follow(dev, item);
+	if (!dptr)
+		return NULL;
+	if (!dptr->data) {
+		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
+		if (!dptr->data)
+			return NULL;
+		memset(dptr->data, 0, qset * sizeof(char *));
+	}
+	/* Allocate a quantum using virtual addresses */
+	if (!dptr->data[s_pos]) {
+		dptr->data[s_pos] = (void *)vmalloc(PAGE_SIZE << dev->order);
+		if (!dptr->data[s_pos])
+			return NULL;
+		memset(dptr->data[s_pos], 0, PAGE_SIZE << dev->order);
+	}
+	return dptr->data[s_pos];
+}
+
 ssize_t scullv_write (struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
 	struct scullv_dev *dev = filp->private_data;
-	struct scullv_dev *dptr;
+	void *qptr;
 	int quantum = PAGE_SIZE << dev->order;
 	int qset = dev->qset;
 	int itemsize = quantum * qset;
 	int item, s_pos, q_pos, rest;
 	ssize_t retval = -ENOMEM; /* our most likely error */
 
+	/* items are numbered with an int: there is no storing past that */
+	if (*f_pos < 0 || *f_pos >= (loff_t)INT_MAX * itemsize)
+		return -EFBIG;
 	if (mutex_lock_interruptible(&dev->mutex))
 		return -ERESTARTSYS;
 
@@ -227,24 +296,13 @@ ssize_t scullv_write (struct file *filp, const char __user *buf, size_t count,
 	rest = ((long) *f_pos) % itemsize;
 	s_pos = rest / quantum; q_pos = rest % quantum;
 
-	/* follow the list up to the right position */
-	dptr = scullv_follow(dev, item);
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(void *), GFP_KERNEL);
-		if (!dptr->data)
-			goto nomem;
-		memset(dptr->data, 0, qset * sizeof(char *));
-	}
-	/* Allocate a quantum using virtual addresses */
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = (void *)vmalloc(PAGE_SIZE << dptr->order);
-		if (!dptr->data[s_pos])
-			goto nomem;
-		memset(dptr->data[s_pos], 0, PAGE_SIZE << dptr->order);
-	}
+	/* follow the list up to the right position, allocating */
+	qptr = scullv_quantum(dev, item, s_pos);
+	if (!qptr)
+		goto nomem;
 	if (count > quantum - q_pos)
 		count = quantum - q_pos; /* write only up to the end of this quantum */
-	if (copy_from_user (dptr->data[s_pos]+q_pos, buf, count)) {
+	if (copy_from_user (qptr+q_pos, buf, count)) {
 		retval = -EFAULT;
 		goto nomem;
 	}
@@ -269,6 +327,7 @@ long scullv_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
 
 	int err = 0, ret = 0, tmp;
+	struct scullv_msync ms;
 
 	/* don't even decode wrong cmds: better returning  ENOTTY than EFAULT */
 	if (_IOC_TYPE(cmd) != SCULLV_IOC_MAGIC) return -ENOTTY;
@@ -348,6 +407,11 @@ long scullv_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 		scullv_qset = arg;
 		return tmp;
 
+	case SCULLV_IOCMSYNC: /* the mapping: see mmap.c */
+		if (copy_from_user(&ms, (void __user *)arg, sizeof(ms)))
+			return -EFAULT;
+		return scullv_msync(filp, &ms);
+
 	default:  /* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
 	}
@@ -389,6 +453,27 @@ loff_t scullv_llseek (struct file *filp, loff_t off, int whence)
  * Mmap *is* available, but confined in a different file
  */
 extern int scullv_mmap(struct file *filp, struct vm_area_struct *vma);
+extern int scullv_fadvise(struct file *filp, loff_t offset, loff_t len,
+		int advice);
+
+
+/*
+ * Asynchronous and vectored I/O: hand the request to this device's
+ * submission queue, which runs the read/write methods above
+ */
+ssize_t scullv_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct scullv_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_read_iter(&dev->aq, iocb, to);
+}
+
+ssize_t scullv_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct scullv_dev *dev = iocb->ki_filp->private_data;
+
+	return scull_async_write_iter(&dev->aq, iocb, from);
+}
 
 
 /*
@@ -402,10 +487,11 @@ struct file_operations scullv_fops = {
 	.write =     scullv_write,
 	.unlocked_ioctl = scullv_ioctl,
 	.mmap =	     scullv_mmap,
+	.fadvise =   scullv_fadvise,
 	.open =	     scullv_open,
 	.release =   scullv_release,
-	.read_iter =  scull_read_iter,
-	.write_iter = scull_write_iter,
+	.read_iter =  scullv_read_iter,
+	.write_iter = scullv_write_iter,
 };
 
 int scullv_trim(struct scullv_dev *dev)
@@ -430,6 +516,10 @@ int scullv_trim(struct scullv_dev *dev)
 		next=dptr->next;
 		if (dptr != dev) kfree(dptr); /* all of them but the first */
 	}
+	kvfree(dev->items);
+	dev->items = NULL;
+	dev->nitems = dev->maxitems = 0;
+	xa_destroy(&dev->dirty);
 	dev->size = 0;
 	dev->qset = scullv_qset;
 	dev->order = scullv_order;
@@ -474,6 +564,12 @@ int scullv_init(void)
 	if (result < 0)
 		return result;
 
+	result = scull_async_init("scullv");
+	if (result < 0) {
+		unregister_chrdev_region(dev, scullv_devs);
+		return result;
+	}
+
 	
 	/* 
 	 * allocate the devices -- we can't have them static, as the number
@@ -489,6 +585,8 @@ int scullv_init(void)
 		scullv_devices[i].order = scullv_order;
 		scullv_devices[i].qset = scullv_qset;
 		mutex_init(&scullv_devices[i].mutex);
+		xa_init(&scullv_devices[i].dirty);
+		scull_async_init_queue(&scullv_devices[i].aq);
 		scullv_setup_cdev(scullv_devices + i, i);
 	}
 
@@ -499,6 +597,7 @@ int scullv_init(void)
 	return 0; /* succeed */
 
   fail_malloc:
+	scull_async_cleanup();
 	unregister_chrdev_region(dev, scullv_devs);
 	return result;
 }
@@ -515,9 +614,11 @@ void scullv_cleanup(void)
 
 	for (i = 0; i < scullv_devs; i++) {
 		cdev_del(&scullv_devices[i].cdev);
+		scull_async_flush_queue(&scullv_devices[i].aq);
 		scullv_trim(scullv_devices + i);
 	}
 	kfree(scullv_devices);
+	scull_async_cleanup();
 	unregister_chrdev_region(MKDEV (scullv_major, 0), scullv_devs);
 }
 
@@ -21,6 +21,9 @@
 #include <linux/errno.h>	/* error codes */
 #include <asm/pgtable.h>
 #include <linux/fs.h>
+#include <linux/vmalloc.h>	/* vmalloc_to_page() */
+#include <linux/sched.h>	/* current */
+#include <linux/fadvise.h>	/* POSIX_FADV_WILLNEED */
 
 #include "scullv.h"		/* local definitions */
 
@@ -44,68 +47,186 @@ void scullv_vma_close(struct vm_area_struct *vma)
 	dev->vmas--;
 }
 
+/*
+ * Find the page at "pgoff" in the device, or NULL for holes and past
+ * the end: the quantum first, then the page within it. Each page of a
+ * vmalloc area has its own count, so any order can be mapped. The list
+ * items are indexed (see scullv_follow), so the cost doesn't depend on
+ * the offset. With "create", holes are filled and the end doesn't
+ * matter. Called with the device mutex held.
+ */
+static struct page *scullv_find_page(struct scullv_dev *dev, pgoff_t pgoff,
+		int create)
+{
+	struct scullv_dev *ptr;
+	unsigned long quantum;
+	void *pageptr = NULL;
+
+	quantum = pgoff >> dev->order;
+	if (create)
+		pageptr = scullv_quantum(dev, quantum / dev->qset,
+				quantum % dev->qset);
+	else if (pgoff < (dev->size + PAGE_SIZE - 1) >> PAGE_SHIFT) {
+		ptr = scullv_follow(dev, quantum / dev->qset);
+		if (ptr && ptr->data)
+			pageptr = ptr->data[quantum % dev->qset];
+	}
+	if (!pageptr)
+		return NULL; /* hole or end-of-file */
+	pageptr += (pgoff & ((1 << dev->order) - 1)) << PAGE_SHIFT;
+
+	/*
+	 * "pageptr" is now the address of the page needed by the
+	 * current process. Since it's a vmalloc address, turn it
+	 * into a struct page.
+	 */
+	return vmalloc_to_page(pageptr);
+}
+
+/*
+ * May a store through a shared mapping make the device reach "pgoff"?
+ * Up to its size, sure; beyond, only to scullv_map_max, and never
+ * past what the item index can number. Checked before anything is
+ * allocated, so that one fault can't make the list grow at will.
+ */
+static int scullv_may_grow(struct scullv_dev *dev, pgoff_t pgoff)
+{
+	loff_t itemsize = (loff_t)(PAGE_SIZE << dev->order) * dev->qset;
+
+	if (pgoff < (dev->size + PAGE_SIZE - 1) >> PAGE_SHIFT)
+		return 1;
+	return pgoff < READ_ONCE(scullv_map_max) >> PAGE_SHIFT
+		&& pgoff < (INT_MAX * itemsize) >> PAGE_SHIFT;
+}
+
+/*
+ * Map the pages we have between "start" and "end" (inclusive, in file
+ * pages) into the area, leaving out "skip", holes and anything already
+ * mapped. vm_insert_page counts each page as nopage does, and works
+ * on an area that is in use because it is VM_MIXEDMAP.
+ * Called with the device mutex held.
+ */
+static void scullv_map_range(struct vm_area_struct *vma, pgoff_t start,
+		pgoff_t end, pgoff_t skip)
+{
+	struct scullv_dev *dev = vma->vm_private_data;
+	struct page *page;
+	pgoff_t pgoff;
+
+	for (pgoff = start; pgoff <= end; pgoff++) {
+		if (pgoff == skip)
+			continue;
+		page = scullv_find_page(dev, pgoff, 0);
+		if (!page) {
+			if (pgoff << PAGE_SHIFT >= dev->size)
+				break; /* nothing more after the end */
+			continue;
+		}
+		vm_insert_page(vma, vma->vm_start +
+				((pgoff - vma->vm_pgoff) << PAGE_SHIFT), page);
+	}
+}
+
+/*
+ * Fault-around, done by hand: a read fault maps the pages we have in
+ * the SCULLV_AROUND-page block around the faulting one too, so that a
+ * walk through the area takes one fault every few pages rather than
+ * one per page. The core's map_pages method would do the same, but it
+ * may be called with the page table locked, where we can't take the
+ * device mutex; here we hold nothing but the mmap semaphore.
+ * Called with the device mutex held.
+ */
+#define SCULLV_AROUND 16	/* pages, 64kB like the core's default */
+
+static void scullv_fault_around(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	pgoff_t start, end;
+
+	start = max(vmf->pgoff & ~(pgoff_t)(SCULLV_AROUND - 1), vma->vm_pgoff);
+	end = min(vmf->pgoff | (SCULLV_AROUND - 1),
+			vma->vm_pgoff + vma_pages(vma) - 1);
+	scullv_map_range(vma, start, end, vmf->pgoff);
+}
+
 /*
  * The nopage method: the core of the file. It retrieves the
  * page required from the scullv device and returns it to the
  * user. The count for the page must be incremented, because
  * it is automatically decremented at page unmap.
  *
- * For this reason, "order" must be zero. Otherwise, only the first
- * page has its count incremented, and the allocating module must
- * release it as a whole block. Therefore, it isn't possible to map
- * pages from a multipage block: when they are unmapped, their count
- * is individually decreased, and would drop to 0.
+ * A store through a shared mapping gets here first for a page that
+ * is not mapped yet: the page is allocated if missing, and the device
+ * grows in page_mkwrite, which is called next.
  */
 
 static int scullv_vma_nopage(struct vm_fault *vmf)
 {
-	unsigned long offset;
 	struct vm_area_struct *vma = vmf->vma;
-	struct scullv_dev *ptr, *dev = vma->vm_private_data;
-	struct page *page = NULL;
-	void *pageptr = NULL; /* default to "missing" */
-	int retval = VM_FAULT_NOPAGE;
-
-	mutex_lock(&dev->mutex);
-	offset = (unsigned long)(vmf->address - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
-	if (offset >= dev->size) goto out; /* out of range */
+	struct scullv_dev *dev = vma->vm_private_data;
+	struct page *page;
+	int create, retval = VM_FAULT_SIGBUS;
 
 	/*
-	 * Now retrieve the scullv device from the list,then the page.
 	 * If the device has holes, the process receives a SIGBUS when
-	 * accessing the hole.
+	 * reading the hole.
 	 */
-	offset >>= PAGE_SHIFT; /* offset is a number of pages */
-	for (ptr = dev; ptr && offset >= dev->qset;) {
-		ptr = ptr->next;
-		offset -= dev->qset;
+	create = (vmf->flags & FAULT_FLAG_WRITE) && (vma->vm_flags & VM_SHARED);
+	mutex_lock(&dev->mutex);
+	if (create && !scullv_may_grow(dev, vmf->pgoff)) {
+		mutex_unlock(&dev->mutex);
+		return VM_FAULT_SIGBUS;
 	}
-	if (ptr && ptr->data) pageptr = ptr->data[offset];
-	if (!pageptr) goto out; /* hole or end-of-file */
-
-	/*
-	 * After scullv lookup, "page" is now the address of the page
-	 * needed by the current process. Since it's a vmalloc address,
-	 * turn it into a struct page.
-	 */
-	page = vmalloc_to_page(pageptr);
-
-	/* got it, now increment the count */
-	get_page(page);
-	vmf->page = page;
-	retval = 0;
-
-  out:
+	page = scullv_find_page(dev, vmf->pgoff, create);
+	if (page) {
+		/* got it, now increment the count */
+		get_page(page);
+		vmf->page = page;
+		retval = 0;
+		if (!(vmf->flags & FAULT_FLAG_WRITE))
+			scullv_fault_around(vmf);
+	} else if (create)
+		retval = VM_FAULT_OOM;
 	mutex_unlock(&dev->mutex);
 	return retval;
 }
 
+/*
+ * The first store to a page of a shared mapping comes here (pages are
+ * mapped read-only until then, since we have this method), either
+ * right after nopage or when the page is already mapped. The device
+ * grows to the end of the page, so that read() sees what is stored
+ * there, and the page is entered in the dirty xarray. Our pages have
+ * no address space, so we lock the page ourselves: the core would take
+ * that for a truncated page and retry forever.
+ */
+static int scullv_vma_mkwrite(struct vm_fault *vmf)
+{
+	struct scullv_dev *dev = vmf->vma->vm_private_data;
+	pgoff_t pgoff = vmf->pgoff;
 
+	mutex_lock(&dev->mutex);
+	if (!scullv_may_grow(dev, pgoff)) { /* the limit was lowered */
+		mutex_unlock(&dev->mutex);
+		return VM_FAULT_SIGBUS;
+	}
+	if (xa_err(xa_store(&dev->dirty, pgoff, xa_mk_value(1), GFP_KERNEL))) {
+		mutex_unlock(&dev->mutex);
+		return VM_FAULT_OOM; /* not tracked, so not writable */
+	}
+	if (dev->size < (pgoff + 1) << PAGE_SHIFT)
+		dev->size = (pgoff + 1) << PAGE_SHIFT;
+	mutex_unlock(&dev->mutex);
+
+	lock_page(vmf->page);
+	return VM_FAULT_LOCKED;
+}
 
 struct vm_operations_struct scullv_vm_ops = {
 	.open =     scullv_vma_open,
 	.close =    scullv_vma_close,
 	.fault =   scullv_vma_nopage,
+	.page_mkwrite = scullv_vma_mkwrite,
 };
 
 
@@ -113,9 +234,105 @@ int scullv_mmap(struct file *filp, struct vm_area_struct *vma)
 {
 
 	/* don't do anything here: "nopage" will set up page table entries */
+	vma->vm_flags |= VM_MIXEDMAP; /* but let it insert more */
 	vma->vm_ops = &scullv_vm_ops;
 	vma->vm_private_data = filp->private_data;
 	scullv_vma_open(vma);
 	return 0;
 }
 
+/*
+ * madvise(MADV_WILLNEED) ends up here, with the mmap semaphore
+ * released: map what we have in the range into the caller's mappings
+ * of the device, as scullp does.
+ */
+int scullv_fadvise(struct file *filp, loff_t offset, loff_t len, int advice)
+{
+	struct scullv_dev *dev = filp->private_data;
+	struct mm_struct *mm = current->mm;
+	struct vm_area_struct *vma;
+	pgoff_t start, end, last;
+
+	if (advice != POSIX_FADV_WILLNEED || !mm)
+		return generic_fadvise(filp, offset, len, advice);
+	if (offset < 0 || len < 0)
+		return -EINVAL;
+	start = offset >> PAGE_SHIFT;
+	if (!len || offset + len < offset)
+		end = ULONG_MAX; /* to the end of the file */
+	else
+		end = (offset + len - 1) >> PAGE_SHIFT;
+
+	down_read(&mm->mmap_sem);
+	mutex_lock(&dev->mutex);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		if (vma->vm_ops != &scullv_vm_ops || vma->vm_private_data != dev)
+			continue;
+		last = vma->vm_pgoff + vma_pages(vma) - 1;
+		if (start > last || end < vma->vm_pgoff)
+			continue;
+		scullv_map_range(vma, max(start, vma->vm_pgoff),
+				min(end, last), ULONG_MAX);
+	}
+	mutex_unlock(&dev->mutex);
+	up_read(&mm->mmap_sem);
+	return 0;
+}
+
+/* Unmap pages "start" up to "end" from every mapping of the device */
+static void scullv_unmap(struct file *filp, pgoff_t start, pgoff_t end)
+{
+	unmap_mapping_range(filp->f_mapping, (loff_t)start << PAGE_SHIFT,
+			(loff_t)(end - start) << PAGE_SHIFT, 0);
+}
+
+/*
+ * The msync ioctl (see scullv.h). Nothing needs to be copied, as the
+ * stores went to the device memory, but the dirty pages in the range
+ * are unmapped, so that the next access maps them read-only again and
+ * the next store is seen by page_mkwrite. Runs of dirty pages are
+ * unmapped in one go. Returns the number of dirty pages that were in
+ * the range.
+ */
+int scullv_msync(struct file *filp, struct scullv_msync *ms)
+{
+	struct scullv_dev *dev = filp->private_data;
+	pgoff_t start, end, index, run = 0, next = 0;
+	void *entry;
+	int retval = 0;
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (ms->offset < 0 || ms->len < 0)
+		return -EINVAL;
+	start = ms->offset >> PAGE_SHIFT;
+	if (!ms->len || ms->offset + ms->len < ms->offset)
+		end = ULONG_MAX; /* to the end of the file */
+	else
+		end = (ms->offset + ms->len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+	if (mutex_lock_interruptible(&dev->mutex))
+		return -ERESTARTSYS;
+	if (ms->size > (long long)dev->size) {
+		retval = -EINVAL;
+		goto out;
+	}
+	index = start;
+	for (entry = xa_find(&dev->dirty, &index, end - 1, XA_PRESENT); entry;
+	     entry = xa_find_after(&dev->dirty, &index, end - 1, XA_PRESENT)) {
+		xa_erase(&dev->dirty, index);
+		if (!retval++ || index != next) { /* a new run */
+			if (next > run)
+				scullv_unmap(filp, run, next);
+			run = index;
+		}
+		next = index + 1;
+	}
+	if (next > run)
+		scullv_unmap(filp, run, next);
+	if (ms->size >= 0)
+		dev->size = ms->size;
+  out:
+	mutex_unlock(&dev->mutex);
+	return retval;
+}
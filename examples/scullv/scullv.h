@@ -14,8 +14,12 @@
  */
 
 #include <linux/ioctl.h>
+#ifdef __KERNEL__
 #include <linux/cdev.h>
+#include <linux/xarray.h>
+#include "scull-shared/scull-async.h"
 #include <linux/semaphore.h>
+#endif
 
 /*
  * Macros to help debugging
@@ -53,15 +57,27 @@
 #define SCULLV_ORDER    4 /* 16 pages at a time */
 #define SCULLV_QSET     500
 
+/*
+ * Stores through a shared mapping grow the device, but only up to
+ * this many bytes; past it they get a SIGBUS. write() is not bound.
+ */
+#define SCULLV_MAP_MAX  (64L << 20)
+
+#ifdef __KERNEL__ /* the rest is for the driver; the ioctls are for all */
+
 struct scullv_dev {
 	void **data;
 	struct scullv_dev *next;  /* next listitem */
+	struct scullv_dev **items;   /* all the listitems, in the first one */
+	int nitems, maxitems;     /* how many are in there, and room for */
+	struct xarray dirty;      /* pages stored to since the last msync */
 	int vmas;                 /* active mappings */
 	int order;                /* the current allocation order */
 	int qset;                 /* the current array size */
 	size_t size;              /* 32-bit will suffice */
 	struct mutex mutex;     /* Mutual exclusion */
 	struct cdev cdev;
+	struct scull_async_queue aq; /* asynchronous requests */
 };
 
 extern struct scullv_dev *scullv_devices;
@@ -74,6 +90,7 @@ extern struct file_operations scullv_fops;
 extern int scullv_major;     /* main.c */
 extern int scullv_devs;
 extern int scullv_order;
+extern long scullv_map_max;
 extern int scullv_qset;
 
 /*
@@ -81,6 +98,9 @@ extern int scullv_qset;
  */
 int scullv_trim(struct scullv_dev *dev);
 struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n);
+void *scullv_quantum(struct scullv_dev *dev, int item, int s_pos);
+
+#endif /* __KERNEL__ */
 
 
 #ifdef SCULLV_DEBUG
@@ -117,7 +137,27 @@ struct scullv_dev *scullv_follow(struct scullv_dev *dev, int n);
 #define SCULLV_IOCXQSET    _IOWR(SCULLV_IOC_MAGIC,11, int)
 #define SCULLV_IOCHQSET    _IO(SCULLV_IOC_MAGIC,  12)
 
-#define SCULLV_IOC_MAXNR 12
+/*
+ * Stores through a shared mapping land in the device memory itself,
+ * growing it a page at a time. This tells the driver that the pages
+ * in the range were written back: the next store to each is tracked
+ * again. If "size" is not negative, it becomes the size of the
+ * device, so that producers can set where their data ends; it can't
+ * be larger than the current size.
+ */
+struct scullv_msync {
+	long long offset;
+	long long len;       /* 0 means up to the end */
+	long long size;
+};
+
+#define SCULLV_IOCMSYNC    _IOW(SCULLV_IOC_MAGIC, 13, struct scullv_msync)
+
+#ifdef __KERNEL__
+int scullv_msync(struct file *filp, struct scullv_msync *ms);
+#endif
+
+#define SCULLV_IOC_MAXNR 13
 
 
 